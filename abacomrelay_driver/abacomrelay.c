@@ -14,6 +14,23 @@
  * Creates device /dev/usb/relayboard0,1,2..
  * Allows writing 1 byte value with state (0/1) for each of the 8 relays
  * Allows reading 1 byte value with state of the 8 relays
+ * Both as decimal text by default, or as raw bytes after switching the open 
+ * file to binary mode (see abacomrelay.h)
+ * Reads return the state from offset 0 and end of file after it, pread() at
+ * offset 0 always gets the current state on the same open file
+ * poll() reports the device readable once the state changed since the last
+ * read on that file
+ * The interface in sysfs has state, pending_state and relay1..relay8 to read
+ * and set the state or single relays as text
+ * mmap() maps a read-only page with the state, see struct relayboard_shared
+ * A background check notices when the relay supply fails and comes back, it
+ * shows in sysfs (power_fail) and as EPOLLPRI
+ * With GPIO support, each board is also a gpio_chip with 8 output lines
+ * named relayboardN-relay1 to relayboardN-relay8
+ * With the verify module parameter, every state change also reads back what
+ * the board held before and if its relays have supply
+ * Tracepoints for transfers, state changes and locking are in
+ * abacomrelay_trace.h
  *
  * Updated 01.04.2023 by Jonas Keunecke (drjones16@web.de)
  * https://github.com/jonesman/ABACOM-Relayboard
@@ -28,6 +45,27 @@
 #include <linux/errno.h>
 #include <linux/kref.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/file.h>
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/errseq.h>
+#include <linux/mm.h>
+#include <linux/delay.h>
+#include <linux/gpio/driver.h>
+
+#include "abacomrelay.h"
+
+#define CREATE_TRACE_POINTS
+#include "abacomrelay_trace.h"
 
 /*
  *	Metainformation
@@ -46,20 +84,120 @@ MODULE_DESCRIPTION( "Driver for the ABACOM usb relayboard." );
 #define USB_RELAYBOARD_VENDOR_ID	0x1a86 
 #define USB_RELAYBOARD_PRODUCT_ID	0x5512
 #define USB_RELAYBOARD_MINOR_BASE	0
-#define RELAY_READ_FREQ_MAX			(HZ / 2) //500ms
 #define RELAY_CMD(b)				{0xa1,0x6a,0x1f,0x00,0x10,b,0x3f,0x00,0x00,0x00,0x00}
 #define RELAY_CMD_LENGTH			11
+#define RELAY_CMD_DATA_OFFSET		5
+/* CH341 command to read the D0..D7 lines and the length of its answer */
+#define RELAY_INPUT_CMD				0xa0
+#define RELAY_INPUT_LENGTH			6
+/* Allegro A6275 driver chip lines on the CH341 data lines (see usblrb.py) */
+#define RELAY_PIN_LATCH				0x01
+#define RELAY_PIN_CLK				0x08
+#define RELAY_PIN_DATA				0x20
+#define RELAY_PIN_PFT				0x40	/* port function test, A6275 PIN5 */
+#define RELAY_PIN_READ				0x80	/* A6275 serial out */
+/* One state change: start frame, 3 frames per bit, 2 frames to latch, the
+	compact encoding needs 2 frames per bit and 1 to latch */
+#define RELAY_FRAME_COUNT			(1 + 8 * 3 + 2)
+#define RELAY_SEQ_LENGTH			(RELAY_FRAME_COUNT * RELAY_CMD_LENGTH)
+/* Layout of the buffer for input reads */
+#define RELAY_IO_CMD				0
+#define RELAY_IO_INPUT				8
+#define RELAY_IO_LENGTH				(RELAY_IO_INPUT + RELAY_INPUT_LENGTH)
+/* Number of urbs each device owns for pipelining single frames */
+#define RELAY_URB_COUNT				8
+/* States of the pulse engine */
+#define RELAY_PULSE_IDLE			0
+#define RELAY_PULSE_STARTING		1	/* waiting for the relays to switch on */
+#define RELAY_PULSE_RUNNING			2	/* timer runs until they switch off */
+/* Longest sequence the driver takes */
+#define RELAY_SEQ_MAX_STEPS			65536
+/* Shortest loop a sequence may play, one pass has to take at least this
+	long and at least as long as a state change */
+#define RELAY_SEQ_MIN_LOOP_US		1000
+/* Most boards switched by one group write */
+#define RELAY_GROUP_MAX				16
+/* Latency histograms have log2 buckets of microseconds, the first one is
+	below 1us, the last one takes everything from 2^(n-2)us on */
+#define RELAY_HIST_BUCKETS			24
+/* Fits "relayboard255-relay8" */
+#define RELAY_GPIO_NAME_LENGTH		24
+
+/*
+ * Module parameters
+ */
+
+static bool batch = true;
+module_param(batch, bool, 0644);
+MODULE_PARM_DESC(batch, "Send the frame sequence of a state change in one bulk transfer (default: 1)");
+
+static int urbs_in_flight = 4;
+module_param(urbs_in_flight, int, 0644);
+MODULE_PARM_DESC(urbs_in_flight, "Frames in flight at once when frames are sent singly (1-8, default: 4)");
+
+static bool verify = false;
+module_param(verify, bool, 0644);
+MODULE_PARM_DESC(verify, "Read the old register contents and the relay supply back while shifting out a state (default: 0)");
+
+static unsigned int monitor_ms = 500;
+module_param(monitor_ms, uint, 0644);
+MODULE_PARM_DESC(monitor_ms, "Interval of the background check of the relay supply in ms, 0 stops it (default: 500)");
+
+static bool compact_frames = true;
+module_param(compact_frames, bool, 0644);
+MODULE_PARM_DESC(compact_frames, "Shift out states with 17 instead of 27 frames (default: 1)");
+
+static unsigned int xfer_timeout_ms = 2000;
+module_param(xfer_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(xfer_timeout_ms, "Timeout of a single USB transfer in ms (default: 2000)");
+
+static unsigned int retries = 3;
+module_param(retries, uint, 0644);
+MODULE_PARM_DESC(retries, "Times a failed state change is sent again within its deadline (default: 3)");
+
+static unsigned int retry_delay_ms = 10;
+module_param(retry_delay_ms, uint, 0644);
+MODULE_PARM_DESC(retry_delay_ms, "Pause before the first retry in ms, doubled for each further one (default: 10)");
+
+static unsigned int deadline_ms = 5000;
+module_param(deadline_ms, uint, 0644);
+MODULE_PARM_DESC(deadline_ms, "Time a state change may take in ms, 0 for no limit (default: 5000)");
 
 /*
  * Our struct definitions
  */
 
+/* Counters shown in debugfs, updated without any lock */
+struct relayboard_stats {
+	/* State changes sent and writes asking for the state the board shows */
+	atomic64_t			writes;
+	atomic64_t			noop_writes;
+	atomic64_t			frames;
+	/* Transfers that failed and ones that got out only partially */
+	atomic64_t			bulk_errors;
+	atomic64_t			short_xfers;
+	atomic64_t			lock_wait_ns;
+	/* State changes sent again after a failure and stalls cleared */
+	atomic64_t			retries;
+	atomic64_t			halts_cleared;
+	/* From the first frame to the latch of a state change and from submit
+		to completion of a transfer (a single frame unless batched) */
+	atomic_t			write_hist[RELAY_HIST_BUCKETS];
+	atomic_t			xfer_hist[RELAY_HIST_BUCKETS];
+};
+
 /* Structure definition to hold all device (instance) specific information */
 struct usb_relayboard {
 	/* The usb_device for this device */
 	struct usb_device	*udev;		
 	/* The usb_interface for this device */
 	struct usb_interface	*interface;		
+	/* Minor of the device node, kept for tracing after disconnect */
+	int					minor;
+	/* Bulk pipes to send frames and commands and to get answers, endpoint 2
+		on the board itself */
+	unsigned int		out_pipe;
+	unsigned int		in_pipe;
 	/* Reference counter, the driver itself is "1", each open increases, each close 
 		decreases ... if count is 0, free this object */
 	struct kref			kref;
@@ -68,13 +206,133 @@ struct usb_relayboard {
 	/* 1 byte holding the state of each relay on the board (this one can't be
 		queried from the device itself) */
 	__u8				relay_states; 
+	/* Counts the changes of relay_states, poll waits on state_wait for it */
+	unsigned long		state_gen;
+	wait_queue_head_t	state_wait;
+	/* Set once the board refused a batched frame sequence twice in a row
+		while single frames got through, or garbled the batch on probe, 
+		from then on every frame is sent on its own */
+	bool				batch_rejected;
+	/* Transfer buffer for a whole frame sequence and the urbs to send it,
+		all allocated once on probe so the write path doesn't allocate */
+	char				*frames;
+	dma_addr_t			frames_dma;
+	char				*io;
+	dma_addr_t			io_dma;
+	struct urb			*urbs[RELAY_URB_COUNT];
+	ktime_t				urb_start[RELAY_URB_COUNT];
+	/* Submitted urbs, the number of them not yet completed and the first
+		error a completion reported */
+	struct usb_anchor	submitted;
+	atomic_t			urbs_busy;
+	int					urb_error;
+	wait_queue_head_t	urb_wait;
+	/* End of the time the current operation may take (jiffies) and the 
+		frames of it that reached the board */
+	unsigned long		deadline;
+	atomic_t			frames_sent;
+	/* The state writes asked for and the work shifting it out. Writes 
+		arriving while the work is busy only replace target_state, so the
+		board always gets the newest one. queue_busy stays set until the 
+		work finds nothing left to send */
+	spinlock_t			queue_lock;
+	__u8				target_state;
+	bool				target_pending;
+	bool				queue_busy;
+	/* Errors of state changes, each file gets those that happened after 
+		it was opened once, on fsync or close */
+	errseq_t			queue_errseq;
+	int					last_error;
+	/* The last state change failed after frames_done of frames_total */
+	bool				last_failed;
+	/* RELAYBOARD_STATUS_MISMATCH from the last verified state change */
+	__u16				verify_flags;
+	/* The relays have no supply, as the last verified state change, 
+		read-back or background check saw it. power_gen counts the changes */
+	bool				power_fail;
+	unsigned long		power_gen;
+	struct delayed_work	monitor_work;
+	__u8				frames_done;
+	__u8				frames_total;
+	wait_queue_head_t	queue_wait;
+	struct work_struct	write_work;
+	/* State the frames in the transfer buffer belong to, for tracing */
+	__u8				frames_state;
+	/* Every queued write gets the next generation, done_gen is the last one
+		the work handled and ok_gen the last one that reached the board */
+	unsigned long		queued_gen;
+	unsigned long		done_gen;
+	unsigned long		ok_gen;
+	/* Changes of relay_states, state_gen, target_state and queue_busy are
+		made under queue_lock inside this, so readers get a consistent 
+		snapshot without taking any lock */
+	seqcount_spinlock_t	state_seq;
+	/* The same for mmap(), a page userspace reads like state_seq, see 
+		struct relayboard_shared */
+	struct relayboard_shared	*shared;
+	/* When the last state change latched and how long state changes take
+		from the first frame to the latch, on average */
+	ktime_t				latch_time;
+	s64					shift_ns;
+	/* Timed pulse, under queue_lock. The relays in pulse_mask switch on with
+		generation pulse_gen and off again pulse_width after that latched */
+	int					pulse_state;
+	__u8				pulse_mask;
+	s64					pulse_width;
+	unsigned long		pulse_gen;
+	struct hrtimer		pulse_timer;
+	struct work_struct	pulse_work;
+	/* Loaded sequence and its playback. seq_mutex serialises loading, 
+		starting and stopping, the playback state is under queue_lock. 
+		seq_time is when step seq_step should latch */
+	struct mutex		seq_mutex;
+	struct relayboard_step	*seq_steps;
+	unsigned int		seq_count;
+	unsigned int		seq_step;
+	unsigned int		seq_loops;
+	bool				seq_running;
+	bool				seq_loop;
+	ktime_t				seq_time;
+	struct hrtimer		seq_timer;
+	struct work_struct	seq_work;
+	struct relayboard_stats	stats;
+	struct dentry		*debugfs;
+#if IS_ENABLED(CONFIG_GPIOLIB)
+	/* The relays as 8 output lines, line 0 is relay 1. Line names carry 
+		the board, so they stay unique with several boards */
+	struct gpio_chip	gpio;
+	bool				gpio_registered;
+	char				gpio_name[8][RELAY_GPIO_NAME_LENGTH];
+	const char			*gpio_names[8];
+#endif
 };
 #define to_relayboard_dev(d) container_of(d, struct usb_relayboard, kref)
 
 /* A struct to hold some file instance specific information */
 struct file_additions {
 	struct usb_relayboard *device;
-	unsigned long last_call; /* value in jiffies */
+	/* Raw bytes instead of decimal text, see RELAYBOARD_MODE_BINARY */
+	bool binary;
+	/* The state_gen this file has read and the power_gen it got the 
+		status with */
+	unsigned long seen_gen;
+	unsigned long seen_power_gen;
+	/* Longest wait for the board in ms, 0 for no limit */
+	unsigned int timeout_ms;
+	/* Position in queue_errseq of the device this file reported up to */
+	errseq_t err_since;
+};
+
+/* A board taking part in a group write */
+struct relayboard_group_member {
+	struct file *file;
+	struct usb_relayboard *dev;
+	struct relayboard_group_entry *entry;
+	__u8 state;
+	int count;
+	bool batched;
+	int result;
+	ktime_t start;
 };
 
 /*
@@ -84,14 +342,441 @@ struct file_additions {
 static int relayboard_probe(struct usb_interface *interface,
 		      const struct usb_device_id *id);
 static void relayboard_disconnect(struct usb_interface *interface);
+static void relayboard_free(struct kref *kref);
 static int relayboard_open(struct inode *inode, struct file *file);
 static int relayboard_close(struct inode *inode, struct file *file);
 static ssize_t relayboard_read(struct file *file, char *buffer, size_t count,
 			 loff_t *ppos);
 static ssize_t relayboard_write(struct file *file, const char *user_buffer,
 			  size_t count, loff_t *ppos);
+static int relayboard_fsync(struct file *file, loff_t start, loff_t end,
+			  int datasync);
+static int relayboard_flush(struct file *file, fl_owner_t id);
+static int relayboard_mmap(struct file *file, struct vm_area_struct *vma);
+static __poll_t relayboard_poll(struct file *file, poll_table *wait);
+static long relayboard_ioctl(struct file *file, unsigned int cmd,
+			  unsigned long arg);
+static int relayboard_change_status(struct file *file, __u8 mask, __u8 status,
+			  __u8 flip);
+static void relayboard_get_status(struct usb_relayboard *dev,
+			  struct relayboard_status *status, unsigned long *gen);
+static int relayboard_start_pulse(struct file *file,
+			  const struct relayboard_pulse *pulse);
+static void relayboard_pulse_started(struct usb_relayboard *dev,
+			  unsigned long gen, int result);
+static enum hrtimer_restart relayboard_pulse_timer(struct hrtimer *timer);
+static void relayboard_pulse_work(struct work_struct *work);
+static int relayboard_load_sequence(struct usb_relayboard *dev,
+			  const struct relayboard_sequence *seq);
+static int relayboard_start_sequence(struct usb_relayboard *dev, __u32 flags);
+static void relayboard_stop_sequence(struct usb_relayboard *dev);
+static void relayboard_get_seq_status(struct usb_relayboard *dev,
+			  struct relayboard_seq_status *status);
+static enum hrtimer_restart relayboard_seq_timer(struct hrtimer *timer);
+static void relayboard_seq_work(struct work_struct *work);
+static int relayboard_group_set(const struct relayboard_group *group);
+static int relayboard_group_send(struct relayboard_group_member *members,
+			  int count);
+static int relayboard_group_shift(struct relayboard_group_member *member);
+static void relayboard_group_failed(struct relayboard_group_member *member);
+static bool __relayboard_queue_status(struct usb_relayboard *dev, __u8 mask,
+			  __u8 status, __u8 flip, unsigned long *gen, bool *idle);
+static void relayboard_kick_work(struct usb_relayboard *dev);
+static void relayboard_state_begin(struct usb_relayboard *dev);
+static void relayboard_state_end(struct usb_relayboard *dev);
+static int relayboard_queue_status(struct usb_relayboard *dev, __u8 mask,
+			  __u8 status, __u8 flip, unsigned long *gen);
+static int relayboard_wait_status(struct usb_relayboard *dev, unsigned long gen,
+			  unsigned int timeout_ms, errseq_t *since);
+static int relayboard_wait_queue(struct usb_relayboard *dev,
+			  unsigned int timeout_ms);
+static void relayboard_write_work(struct work_struct *work);
 static int relayboard_send_status(struct usb_relayboard *dev, __u8 status);
-static int send_relay_cmd(struct usb_relayboard *dev, char cmd);
+static void relayboard_latched(struct usb_relayboard *dev, __u8 status,
+			  ktime_t start);
+static void relayboard_set_power(struct usb_relayboard *dev, bool power_fail);
+static bool relayboard_power_state(__u8 state, __u8 input, bool *power_fail);
+static void relayboard_monitor_work(struct work_struct *work);
+static int relayboard_read_register(struct usb_relayboard *dev, __u8 *state,
+			  bool *power_fail);
+static int relayboard_build_frames(char *frames, __u8 status, bool latch);
+static void relayboard_fill_frames(char *frames, const char *pins, int count);
+static int relayboard_send_sequence(struct usb_relayboard *dev, int first,
+			  int count);
+static int relayboard_read_input(struct usb_relayboard *dev, __u8 *input);
+static bool relayboard_gone(int error);
+static bool relayboard_batch_refused(int error);
+static int relayboard_batch_failed(struct usb_relayboard *dev, int first,
+			  int count, int error);
+static void relayboard_check_batch(struct usb_relayboard *dev);
+static void relayboard_recover(struct usb_relayboard *dev, int error,
+			  unsigned int attempt);
+static int relayboard_send_verified(struct usb_relayboard *dev, int count,
+			  __u8 *old, bool *power_fail);
+static int relayboard_shift_and_read(struct usb_relayboard *dev, int first,
+			  int count, __u8 *input);
+static int relayboard_submit(struct usb_relayboard *dev, struct urb *urb,
+			  unsigned int pipe, char *buffer, dma_addr_t dma, int length);
+static void relayboard_start_deadline(struct usb_relayboard *dev);
+static void relayboard_lock(struct usb_relayboard *dev);
+static int relayboard_lock_interruptible(struct usb_relayboard *dev);
+static bool relayboard_trylock(struct usb_relayboard *dev);
+static void relayboard_unlock(struct usb_relayboard *dev);
+static unsigned long relayboard_xfer_timeout(struct usb_relayboard *dev);
+static int relayboard_wait_urbs(struct usb_relayboard *dev);
+static int send_relay_frames(struct usb_relayboard *dev, int first, int count,
+			  int chunk);
+
+/*
+ * Sysfs attributes
+ */
+
+/* The attributes sit on the interface, they are removed before the driver
+	lets go of it on disconnect */
+static struct usb_relayboard *relayboard_from_dev(struct device *dev)
+{
+	return usb_get_intfdata(to_usb_interface(dev));
+}
+
+/* Change the relays in mask and wait for the board, like a blocking write */
+static ssize_t relayboard_store_status(struct device *dev, __u8 mask,
+			  __u8 status, size_t count)
+{
+	struct usb_relayboard *board = relayboard_from_dev(dev);
+	unsigned long gen;
+	int result;
+	if (!board) {
+		return -ENODEV;
+	}
+	result = relayboard_queue_status(board, mask, status, 0, &gen);
+	if (!result) {
+		result = relayboard_wait_status(board, gen, 0, NULL);
+	}
+	return result ? result : count;
+}
+
+/* State of the board as decimal number, writes set all relays at once */
+static ssize_t state_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct usb_relayboard *board = relayboard_from_dev(dev);
+	struct relayboard_status status;
+	if (!board) {
+		return -ENODEV;
+	}
+	relayboard_get_status(board, &status, NULL);
+	return sysfs_emit(buf, "%d\n", status.state);
+}
+
+static ssize_t state_store(struct device *dev, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	__u8 status;
+	int result;
+	result = kstrtou8(buf, 0, &status);
+	if (result) {
+		return result;
+	}
+	return relayboard_store_status(dev, 0xff, status, count);
+}
+static DEVICE_ATTR_RW(state);
+
+/* State the board will show once queued writes are done */
+static ssize_t pending_state_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	struct usb_relayboard *board = relayboard_from_dev(dev);
+	struct relayboard_status status;
+	if (!board) {
+		return -ENODEV;
+	}
+	relayboard_get_status(board, &status, NULL);
+	return sysfs_emit(buf, "%d\n", status.pending);
+}
+static DEVICE_ATTR_RO(pending_state);
+
+/* 1 while the relays have no supply, pollable for changes */
+static ssize_t power_fail_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	struct usb_relayboard *board = relayboard_from_dev(dev);
+	if (!board) {
+		return -ENODEV;
+	}
+	return sysfs_emit(buf, "%d\n", READ_ONCE(board->power_fail));
+}
+static DEVICE_ATTR_RO(power_fail);
+
+/* relay1..relay8 show 0 or 1 for one relay (relay1 is bit 0), writing one 
+	changes only that relay */
+static ssize_t relayboard_relay_show(struct device *dev, char *buf, int relay)
+{
+	struct usb_relayboard *board = relayboard_from_dev(dev);
+	struct relayboard_status status;
+	if (!board) {
+		return -ENODEV;
+	}
+	relayboard_get_status(board, &status, NULL);
+	return sysfs_emit(buf, "%d\n", !!(status.state & BIT(relay - 1)));
+}
+
+static ssize_t relayboard_relay_store(struct device *dev, const char *buf,
+			  size_t count, int relay)
+{
+	bool on;
+	int result;
+	result = kstrtobool(buf, &on);
+	if (result) {
+		return result;
+	}
+	return relayboard_store_status(dev, BIT(relay - 1), on ? 0xff : 0x00,
+		count);
+}
+
+#define RELAY_ATTR(n) \
+static ssize_t relay##n##_show(struct device *dev, \
+			  struct device_attribute *attr, char *buf) \
+{ \
+	return relayboard_relay_show(dev, buf, n); \
+} \
+static ssize_t relay##n##_store(struct device *dev, \
+			  struct device_attribute *attr, const char *buf, size_t count) \
+{ \
+	return relayboard_relay_store(dev, buf, count, n); \
+} \
+static DEVICE_ATTR_RW(relay##n)
+
+RELAY_ATTR(1);
+RELAY_ATTR(2);
+RELAY_ATTR(3);
+RELAY_ATTR(4);
+RELAY_ATTR(5);
+RELAY_ATTR(6);
+RELAY_ATTR(7);
+RELAY_ATTR(8);
+
+static struct attribute *relayboard_attrs[] = {
+	&dev_attr_state.attr,
+	&dev_attr_pending_state.attr,
+	&dev_attr_power_fail.attr,
+	&dev_attr_relay1.attr,
+	&dev_attr_relay2.attr,
+	&dev_attr_relay3.attr,
+	&dev_attr_relay4.attr,
+	&dev_attr_relay5.attr,
+	&dev_attr_relay6.attr,
+	&dev_attr_relay7.attr,
+	&dev_attr_relay8.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(relayboard);
+
+/*
+ * GPIO chip
+ */
+
+#if IS_ENABLED(CONFIG_GPIOLIB)
+
+/* Change the lines in mask and wait for the board, several lines requested
+	together only take one state change. The board may be unplugged while we
+	wait, the reference keeps dev around until the wait is over */
+static int relayboard_gpio_change(struct gpio_chip *chip, __u8 mask,
+			  __u8 values)
+{
+	struct usb_relayboard *dev = gpiochip_get_data(chip);
+	unsigned long gen;
+	int result;
+	kref_get(&dev->kref);
+	result = relayboard_queue_status(dev, mask, values, 0, &gen);
+	if (!result) {
+		result = relayboard_wait_status(dev, gen, 0, NULL);
+	}
+	kref_put(&dev->kref, relayboard_free);
+	return result;
+}
+
+static int relayboard_gpio_get_direction(struct gpio_chip *chip,
+			  unsigned int offset)
+{
+	return GPIO_LINE_DIRECTION_OUT;
+}
+
+static int relayboard_gpio_direction_output(struct gpio_chip *chip,
+			  unsigned int offset, int value)
+{
+	return relayboard_gpio_change(chip, BIT(offset), value ? 0xff : 0x00);
+}
+
+static int relayboard_gpio_get(struct gpio_chip *chip, unsigned int offset)
+{
+	struct relayboard_status status;
+	relayboard_get_status(gpiochip_get_data(chip), &status, NULL);
+	return !!(status.state & BIT(offset));
+}
+
+static void relayboard_gpio_set(struct gpio_chip *chip, unsigned int offset,
+			  int value)
+{
+	relayboard_gpio_change(chip, BIT(offset), value ? 0xff : 0x00);
+}
+
+static void relayboard_gpio_set_multiple(struct gpio_chip *chip,
+			  unsigned long *mask, unsigned long *bits)
+{
+	relayboard_gpio_change(chip, *mask & 0xff, *bits & 0xff);
+}
+
+/* A board without GPIO lines still works through its device node */
+static void relayboard_gpio_init(struct usb_relayboard *dev,
+			  struct usb_interface *interface)
+{
+	struct gpio_chip *chip = &dev->gpio;
+	int result;
+	int i;
+	/* relayboard0-relay1 and so on, like the device node */
+	for (i = 0; i < 8; i++) {
+		snprintf(dev->gpio_name[i], RELAY_GPIO_NAME_LENGTH,
+			"relayboard%d-relay%d", dev->minor, i + 1);
+		dev->gpio_names[i] = dev->gpio_name[i];
+	}
+	chip->label = "abacomrelay";
+	chip->parent = &interface->dev;
+	chip->owner = THIS_MODULE;
+	chip->base = -1;
+	chip->ngpio = 8;
+	chip->names = dev->gpio_names;
+	/* Every change goes over USB */
+	chip->can_sleep = true;
+	chip->get_direction = relayboard_gpio_get_direction;
+	chip->direction_output = relayboard_gpio_direction_output;
+	chip->get = relayboard_gpio_get;
+	chip->set = relayboard_gpio_set;
+	chip->set_multiple = relayboard_gpio_set_multiple;
+	result = gpiochip_add_data(chip, dev);
+	if (result) {
+		printk( KERN_WARNING "abacomrelay: GPIO chip registration failed, error %d.\n",
+			result);
+		return;
+	}
+	dev->gpio_registered = true;
+}
+
+static void relayboard_gpio_exit(struct usb_relayboard *dev)
+{
+	if (dev->gpio_registered) {
+		gpiochip_remove(&dev->gpio);
+		dev->gpio_registered = false;
+	}
+}
+
+#else
+
+static void relayboard_gpio_init(struct usb_relayboard *dev,
+			  struct usb_interface *interface)
+{
+}
+
+static void relayboard_gpio_exit(struct usb_relayboard *dev)
+{
+}
+
+#endif
+
+/*
+ * Statistics in debugfs
+ */
+
+/* abacomrelay/ in debugfs, with a directory for each board */
+static struct dentry *relayboard_debugfs;
+
+static void relayboard_hist_add(atomic_t *hist, s64 ns)
+{
+	/* div_u64(), a plain 64 bit division needs libgcc on 32 bit */
+	u64 us = ns > 0 ? div_u64(ns, NSEC_PER_USEC) : 0;
+	atomic_inc(&hist[us ? min(ilog2(us) + 1, RELAY_HIST_BUCKETS - 1) : 0]);
+}
+
+static void relayboard_hist_show(struct seq_file *m, const char *name,
+			  atomic_t *hist)
+{
+	int i;
+	seq_printf(m, "%s:\n", name);
+	seq_printf(m, "%12s %u\n", "<1us", atomic_read(&hist[0]));
+	for (i = 1; i < RELAY_HIST_BUCKETS - 1; i++) {
+		seq_printf(m, "%10luus %u\n", 1UL << (i - 1), atomic_read(&hist[i]));
+	}
+	seq_printf(m, ">=%8luus %u\n", 1UL << (i - 1), atomic_read(&hist[i]));
+}
+
+static int relayboard_stats_show(struct seq_file *m, void *unused)
+{
+	struct usb_relayboard *dev = m->private;
+	struct relayboard_stats *stats = &dev->stats;
+	seq_printf(m, "writes: %lld\n", atomic64_read(&stats->writes));
+	seq_printf(m, "noop_writes: %lld\n", atomic64_read(&stats->noop_writes));
+	seq_printf(m, "frames: %lld\n", atomic64_read(&stats->frames));
+	seq_printf(m, "bulk_errors: %lld\n", atomic64_read(&stats->bulk_errors));
+	seq_printf(m, "short_transfers: %lld\n", atomic64_read(&stats->short_xfers));
+	seq_printf(m, "lock_wait_ns: %lld\n", atomic64_read(&stats->lock_wait_ns));
+	seq_printf(m, "retries: %lld\n", atomic64_read(&stats->retries));
+	seq_printf(m, "halts_cleared: %lld\n", atomic64_read(&stats->halts_cleared));
+	relayboard_hist_show(m, "write_latency", stats->write_hist);
+	relayboard_hist_show(m, "transfer_latency", stats->xfer_hist);
+	return 0;
+}
+
+static int relayboard_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, relayboard_stats_show, inode->i_private);
+}
+
+static const struct file_operations relayboard_stats_fops = {
+	.owner =	THIS_MODULE,
+	.open =		relayboard_stats_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+/* Any write to reset clears all counters */
+static ssize_t relayboard_reset_write(struct file *file,
+			  const char __user *buffer, size_t count, loff_t *ppos)
+{
+	struct usb_relayboard *dev = file->private_data;
+	struct relayboard_stats *stats = &dev->stats;
+	int i;
+	atomic64_set(&stats->writes, 0);
+	atomic64_set(&stats->noop_writes, 0);
+	atomic64_set(&stats->frames, 0);
+	atomic64_set(&stats->bulk_errors, 0);
+	atomic64_set(&stats->short_xfers, 0);
+	atomic64_set(&stats->lock_wait_ns, 0);
+	atomic64_set(&stats->retries, 0);
+	atomic64_set(&stats->halts_cleared, 0);
+	for (i = 0; i < RELAY_HIST_BUCKETS; i++) {
+		atomic_set(&stats->write_hist[i], 0);
+		atomic_set(&stats->xfer_hist[i], 0);
+	}
+	return count;
+}
+
+static const struct file_operations relayboard_reset_fops = {
+	.owner =	THIS_MODULE,
+	.open =		simple_open,
+	.write =	relayboard_reset_write,
+	.llseek =	noop_llseek,
+};
+
+static void relayboard_debugfs_init(struct usb_relayboard *dev)
+{
+	char name[24];
+	snprintf(name, sizeof(name), "relayboard%d", dev->minor);
+	dev->debugfs = debugfs_create_dir(name, relayboard_debugfs);
+	debugfs_create_file("stats", 0444, dev->debugfs, dev,
+		&relayboard_stats_fops);
+	debugfs_create_file("reset", 0200, dev->debugfs, dev,
+		&relayboard_reset_fops);
+}
 
 /*
  * Descriptors
@@ -110,15 +795,23 @@ static struct usb_driver relayboard_driver = {
 	.id_table =	relayboard_device_table,
 	.probe =	relayboard_probe,
 	.disconnect =	relayboard_disconnect,
+	.dev_groups =	relayboard_groups,
 };
 
 /* Systemcalls provided by this driver */
 static const struct file_operations relayboard_fops = {
 	.owner =	THIS_MODULE,
+	.llseek =	default_llseek,
 	.open =		relayboard_open,
 	.release =	relayboard_close,
 	.read =		relayboard_read,
 	.write =	relayboard_write,
+	.fsync =	relayboard_fsync,
+	.flush =	relayboard_flush,
+	.poll =		relayboard_poll,
+	.mmap =		relayboard_mmap,
+	.unlocked_ioctl =	relayboard_ioctl,
+	.compat_ioctl =	compat_ptr_ioctl,
 };
 
 static char *relay_devnode(struct device *dev, mode_t *mode)
@@ -142,11 +835,14 @@ static struct usb_class_driver relayboard_descriptor = {
 static int __init usb_relayboard_init(void)
 {
 	int result;
+	/* Statistics are optional, debugfs failing is no reason to stop */
+	relayboard_debugfs = debugfs_create_dir("abacomrelay", NULL);
 	/* Don't accidentally provide the usb_class_driver descriptior here or 
 		you will freeze the system on driver loading ! ^^ */
 	if(result = usb_register(&relayboard_driver) ) {
 		printk( KERN_ERR "abacomrelay: Driver registration failed, error %d.\n",
 			result);
+		debugfs_remove_recursive(relayboard_debugfs);
 	}
 	return result;
 }
@@ -154,6 +850,7 @@ static int __init usb_relayboard_init(void)
 static void __exit usb_relayboard_exit(void)
 {
 	usb_deregister(&relayboard_driver);
+	debugfs_remove_recursive(relayboard_debugfs);
 }
 
 module_init(usb_relayboard_init);
@@ -167,6 +864,15 @@ module_exit(usb_relayboard_exit);
 static void relayboard_free(struct kref *kref)
 {
 	struct usb_relayboard *dev = to_relayboard_dev(kref);
+	int i;
+	for (i = 0; i < RELAY_URB_COUNT; i++) {
+		usb_free_urb(dev->urbs[i]);
+	}
+	usb_free_coherent(dev->udev, RELAY_SEQ_LENGTH, dev->frames, dev->frames_dma);
+	usb_free_coherent(dev->udev, RELAY_IO_LENGTH, dev->io, dev->io_dma);
+	/* Mappings still around hold their own reference on the page */
+	free_page((unsigned long)dev->shared);
+	kvfree(dev->seq_steps);
 	usb_put_dev(dev->udev);
 	kfree(dev);
 }
@@ -177,6 +883,7 @@ static int relayboard_probe(struct usb_interface *interface,
 {
 	struct usb_device *device;
 	int result;
+	int i;
 	device = interface_to_usbdev(interface);
 	/* FIXME! As idVendor actually refers to "QinHeng Electronics"(chip vendor)
 		I'm not sure if the combination of idVendor and idProduct is really 
@@ -191,6 +898,13 @@ static int relayboard_probe(struct usb_interface *interface,
 		&& device->config[0].interface[0]->cur_altsetting->desc.bNumEndpoints==3) {
 	/* Initialize our own device structure to hold additional information */
 		struct usb_relayboard *dev;
+		struct usb_endpoint_descriptor *bulk_in, *bulk_out;
+		/* Look the bulk endpoints up instead of assuming the board's 
+			numbers, so a mock board on a gadget controller works as well */
+		if (usb_find_common_endpoints(interface->cur_altsetting, &bulk_in,
+				&bulk_out, NULL, NULL)) {
+			return -ENODEV;
+		}
 		/* Zero the allocated memory, note that this also sets relay_states to
 			"all relays off", which is the board's natural behavior */
 		dev = kzalloc(sizeof(*dev), GFP_KERNEL);
@@ -200,16 +914,64 @@ static int relayboard_probe(struct usb_interface *interface,
 		}
 		kref_init(&dev->kref);
 		sema_init(&dev->mutex, 1);
+		init_usb_anchor(&dev->submitted);
+		atomic_set(&dev->urbs_busy, 0);
+		init_waitqueue_head(&dev->urb_wait);
+		spin_lock_init(&dev->queue_lock);
+		seqcount_spinlock_init(&dev->state_seq, &dev->queue_lock);
+		init_waitqueue_head(&dev->queue_wait);
+		init_waitqueue_head(&dev->state_wait);
+		INIT_WORK(&dev->write_work, relayboard_write_work);
+		hrtimer_init(&dev->pulse_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		dev->pulse_timer.function = relayboard_pulse_timer;
+		INIT_WORK(&dev->pulse_work, relayboard_pulse_work);
+		mutex_init(&dev->seq_mutex);
+		hrtimer_init(&dev->seq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		dev->seq_timer.function = relayboard_seq_timer;
+		INIT_WORK(&dev->seq_work, relayboard_seq_work);
+		INIT_DELAYED_WORK(&dev->monitor_work, relayboard_monitor_work);
 		dev->udev = usb_get_dev(device);
 		dev->interface = interface;
+		dev->out_pipe = usb_sndbulkpipe(dev->udev, usb_endpoint_num(bulk_out));
+		dev->in_pipe = usb_rcvbulkpipe(dev->udev, usb_endpoint_num(bulk_in));
+		dev->frames = usb_alloc_coherent(dev->udev, RELAY_SEQ_LENGTH, GFP_KERNEL,
+			&dev->frames_dma);
+		dev->io = usb_alloc_coherent(dev->udev, RELAY_IO_LENGTH, GFP_KERNEL,
+			&dev->io_dma);
+		/* All zero matches the state of a new board as well */
+		dev->shared = (struct relayboard_shared *)get_zeroed_page(GFP_KERNEL);
+		if (!dev->frames || !dev->io || !dev->shared) {
+			goto nomem;
+		}
+		dev->io[RELAY_IO_CMD] = RELAY_INPUT_CMD;
+		for (i = 0; i < RELAY_URB_COUNT; i++) {
+			dev->urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+			if (!dev->urbs[i]) {
+				goto nomem;
+			}
+			dev->urbs[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		}
 		usb_set_intfdata(interface, dev);
+		relayboard_check_batch(dev);
 	/* Register the device to be used with this driver */
 		if( result = usb_register_dev( interface, &relayboard_descriptor ) ) {
 			printk( KERN_ERR "abacomrelay: Device registration failed, error %d.\n", result);
 			usb_set_intfdata(interface, NULL);
 			kref_put(&dev->kref, relayboard_free);
+		} else {
+			dev->minor = interface->minor;
+			relayboard_debugfs_init(dev);
+			relayboard_gpio_init(dev, interface);
+			if (monitor_ms) {
+				queue_delayed_work(system_wq, &dev->monitor_work,
+					msecs_to_jiffies(monitor_ms));
+			}
 		}
 		return result;
+nomem:
+		printk( KERN_ERR "abacomrelay: Error creating transfer buffer. Out of memory.\n");
+		kref_put(&dev->kref, relayboard_free);
+		return -ENOMEM;
 	}
 	return -ENODEV;
 }
@@ -219,16 +981,39 @@ static int relayboard_probe(struct usb_interface *interface,
 static void relayboard_disconnect(struct usb_interface *interface)
 {
 	struct usb_relayboard *dev;
+	unsigned long flags;
 	dev = usb_get_intfdata(interface);
+	/* Take the GPIO lines away first, changes still on their way fail once
+		the interface is gone */
+	relayboard_gpio_exit(dev);
 	/* Wait for pending operations and deregister device 
 		Waiting is not really necessary for the device, as it disables all 
 		relays on disconnect anyway, but it's meant as a protection against 
 		kernel-oops */
-	down( &dev->mutex );
+	relayboard_lock(dev);
 	usb_set_intfdata(interface, NULL);
 	usb_deregister_dev(interface, &relayboard_descriptor);
+	/* Pulses test it under queue_lock before they start their timer */
+	spin_lock_irqsave(&dev->queue_lock, flags);
 	dev->interface = NULL;
-	up( &dev->mutex );
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	relayboard_unlock(dev);
+	cancel_delayed_work_sync(&dev->monitor_work);
+	debugfs_remove_recursive(dev->debugfs);
+	/* Let pollers see the hangup */
+	wake_up_interruptible_all(&dev->state_wait);
+	/* A playing sequence would keep queueing states */
+	mutex_lock(&dev->seq_mutex);
+	relayboard_stop_sequence(dev);
+	mutex_unlock(&dev->seq_mutex);
+	/* States still queued are dropped by the work now. It has to run 
+		rather than be cancelled, finishing their generations with ENODEV is
+		what wakes writers, fsync and close waiting for them */
+	flush_work(&dev->write_work);
+	/* The work may have started a pulse, which can't switch anything off 
+		anymore */
+	hrtimer_cancel(&dev->pulse_timer);
+	cancel_work_sync(&dev->pulse_work);
 	/* Free memory used by our structure */
 	kref_put(&dev->kref, relayboard_free);
 }
@@ -261,6 +1046,11 @@ static int relayboard_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 	}
     infos->device = dev;
+	/* poll reports changes from now on */
+	infos->seen_gen = dev->state_gen;
+	infos->seen_power_gen = READ_ONCE(dev->power_gen);
+	/* Only errors from now on are this file's to report */
+	infos->err_since = errseq_sample(&dev->queue_errseq);
 	file->private_data = infos;
 	return 0;
 }
@@ -283,109 +1073,1682 @@ static ssize_t relayboard_write(struct file *file, const char *user_buffer,
 			  size_t count, loff_t *ppos)
 {
 	struct file_additions *infos;
-    struct usb_relayboard *dev;
-	char *local_buffer;
-	__u8 user_data;
+	__u8 user_data[2];
+	__u8 mask = 0xff;
+	int result;
 	infos = file->private_data;
-	dev = infos->device;
-	local_buffer = kzalloc(count, GFP_KERNEL);
-    if (!local_buffer) {
-        return -ENOMEM;
-    }
-    if (copy_from_user(local_buffer, user_buffer, count)) {
-		kfree(local_buffer);
-        return -EFAULT;
-    }
-	/* Use only the lower 8 bits of parsed value */
-	user_data = (__u8) simple_strtoul(local_buffer,NULL,10);
-	kfree(local_buffer);
-	down( &dev->mutex );
-    if (relayboard_send_status(dev, user_data)) {
-		count = -EFAULT;
+	if (infos->binary) {
+		/* Either the new state or a mask and the values for those relays */
+		if (count < 1 || count > sizeof(user_data)) {
+			return -EINVAL;
+		}
+		if (copy_from_user(user_data, user_buffer, count)) {
+			return -EFAULT;
+		}
+		if (count == 2) {
+			mask = user_data[0];
+			user_data[0] = user_data[1];
+		}
+	} else {
+		/* Parsed from a small copy on the stack, values above 255 are
+			rejected */
+		result = kstrtou8_from_user(user_buffer, count, 10, user_data);
+		if (result) {
+			return result;
+		}
 	}
-	up( &dev->mutex );
-	return count;
+	result = relayboard_change_status(file, mask, user_data[0], 0);
+	return result ? result : count;
 }
 
-/* Actual communication with the device and saving the status */
-static int relayboard_send_status(struct usb_relayboard *dev, __u8 status) {
-	__u8 mask;
-	/* Send the command frame */
-	if (send_relay_cmd(dev, 0x00)) goto error;
-	for (mask = 128; mask > 0; mask >>= 1) {
-		if (status & mask) {
-			/* Send "relay on" */
-			if (send_relay_cmd(dev, 0x20)) goto error;
-			if (send_relay_cmd(dev, 0x28)) goto error;
-			if (send_relay_cmd(dev, 0x20)) goto error;
-		} else {
-			/* Send "relay off" */
-			if (send_relay_cmd(dev, 0x00)) goto error;
-			if (send_relay_cmd(dev, 0x08)) goto error;
-			if (send_relay_cmd(dev, 0x00)) goto error;
-		}
+/* Queue a state change and wait for it to reach the board, unless the file
+	is non-blocking */
+static int relayboard_change_status(struct file *file, __u8 mask, __u8 status,
+			  __u8 flip)
+{
+	struct file_additions *infos = file->private_data;
+	struct usb_relayboard *dev = infos->device;
+	unsigned long gen;
+	int result;
+	result = relayboard_queue_status(dev, mask, status, flip, &gen);
+	if (!result && !(file->f_flags & O_NONBLOCK)) {
+		result = relayboard_wait_status(dev, gen, infos->timeout_ms,
+			&infos->err_since);
 	}
-	/* End the command frame */
-	if (send_relay_cmd(dev, 0x00)) goto error;
-	if (send_relay_cmd(dev, 0x01)) goto error;
-	/* Remember the status */
-	dev->relay_states = status;
-	return 0;
-error:
-	/* FIXME! Don't know if a "reset" is needed here, I will investigate that 
-		later */
-	return -EFAULT;
+	return result;
 }
 
-static int send_relay_cmd(struct usb_relayboard *dev, char cmd) {
-	char cmd_bytes[] = RELAY_CMD(cmd);
-	char* transfer_bytes = kzalloc(RELAY_CMD_LENGTH, GFP_KERNEL);
-	memcpy(transfer_bytes, &cmd_bytes, RELAY_CMD_LENGTH);
-
-	int actual_length;
-	if (usb_bulk_msg( dev->udev, usb_sndbulkpipe(dev->udev, 2) , transfer_bytes, RELAY_CMD_LENGTH, 
-		&actual_length, HZ*2 )) {
-		kfree(transfer_bytes);
-		return -EFAULT;
+/* Wait until all queued states reached the board, returns the latest error
+	of a state change since the file was opened or last reported one */
+static int relayboard_fsync(struct file *file, loff_t start, loff_t end,
+			  int datasync)
+{
+	struct file_additions *infos = file->private_data;
+	struct usb_relayboard *dev = infos->device;
+	int result;
+	result = relayboard_wait_queue(dev, infos->timeout_ms);
+	if (result) {
+		return result;
 	}
-	kfree(transfer_bytes);
-	return actual_length != RELAY_CMD_LENGTH;
+	return errseq_check_and_advance(&dev->queue_errseq, &infos->err_since);
 }
 
-/* This actually doesn't read from the device but "from the driver" */
-static ssize_t relayboard_read(struct file *file, char *buffer, size_t count,
-			 loff_t *ppos)
+/* Called on every close, so a non-blocking writer still learns about its
+	errors */
+static int relayboard_flush(struct file *file, fl_owner_t id)
 {
-	struct file_additions *infos;
-	struct usb_relayboard *dev;
-	unsigned long timestamp = jiffies;
-	unsigned long time_passed;
-	char state_str[5];
-	/* We won't read if count is too small, because reading one char at a
-		time doesn't make sense, the state could change till next call 
-		We need 3 chars (max. byte = "255") + newline */
-	if (count < 4) {
+	if (!(file->f_mode & FMODE_WRITE)) {
 		return 0;
 	}
-	infos = file->private_data;
-	/* If last read call from this handler was less then RELAY_READ_FREQ_MAX 
-		ms ago, return "end of file", this is to provite functionality for
-		"cat" and allow programs to call "read" multiple times without 
-		the need to re-open the device in one solution */
-	if (infos->last_call > timestamp) {
-		time_passed	= ULONG_MAX - infos->last_call + timestamp + 1;
-	} else {
-		time_passed = timestamp - infos->last_call;
+	return relayboard_fsync(file, 0, LLONG_MAX, 0);
+}
+
+/* Map the status page, read-only. The page outlives the device as long as
+	it is mapped, it just isn't updated anymore after disconnect */
+static int relayboard_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct file_additions *infos = file->private_data;
+	struct usb_relayboard *dev = infos->device;
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE) {
+		return -EINVAL;
+	}
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(dev->shared));
+}
+
+static long relayboard_ioctl(struct file *file, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct file_additions *infos = file->private_data;
+	struct usb_relayboard *dev = infos->device;
+	__u32 __user *argp = (__u32 __user *)arg;
+	struct relayboard_masked masked;
+	struct relayboard_hw_state hw;
+	struct relayboard_status status;
+	struct relayboard_pulse pulse;
+	struct relayboard_sequence seq;
+	struct relayboard_seq_status seq_status;
+	struct relayboard_group group;
+	bool power_fail = false;
+	int result;
+	__u32 mode;
+	__u8 bits;
+	/* Switching relays needs a file opened for writing, as write() does */
+	switch (cmd) {
+	case RELAYBOARD_IOC_SET_BITS:
+	case RELAYBOARD_IOC_CLEAR_BITS:
+	case RELAYBOARD_IOC_TOGGLE_BITS:
+	case RELAYBOARD_IOC_SET_MASKED:
+	case RELAYBOARD_IOC_PULSE:
+	case RELAYBOARD_IOC_SEQ_LOAD:
+	case RELAYBOARD_IOC_SEQ_START:
+	case RELAYBOARD_IOC_SEQ_STOP:
+		if (!(file->f_mode & FMODE_WRITE)) {
+			return -EBADF;
+		}
+		break;
 	}
-	if (time_passed < RELAY_READ_FREQ_MAX) {
+	switch (cmd) {
+	case RELAYBOARD_IOC_SET_MODE:
+		if (get_user(mode, argp)) {
+			return -EFAULT;
+		}
+		if (mode != RELAYBOARD_MODE_TEXT && mode != RELAYBOARD_MODE_BINARY) {
+			return -EINVAL;
+		}
+		infos->binary = mode == RELAYBOARD_MODE_BINARY;
+		return 0;
+	case RELAYBOARD_IOC_GET_MODE:
+		mode = infos->binary ? RELAYBOARD_MODE_BINARY : RELAYBOARD_MODE_TEXT;
+		return put_user(mode, argp);
+	case RELAYBOARD_IOC_SET_TIMEOUT:
+		return get_user(infos->timeout_ms, argp);
+	case RELAYBOARD_IOC_GET_TIMEOUT:
+		return put_user(infos->timeout_ms, argp);
+	case RELAYBOARD_IOC_GET:
+		relayboard_get_status(dev, &status, NULL);
+		return put_user(status.state, (__u8 __user *)arg);
+	case RELAYBOARD_IOC_GET_STATUS:
+		/* Seen by this file now, poll stops reporting EPOLLPRI */
+		infos->seen_power_gen = READ_ONCE(dev->power_gen);
+		relayboard_get_status(dev, &status, NULL);
+		return copy_to_user((void __user *)arg, &status, sizeof(status)) 
+			? -EFAULT : 0;
+	/* All of these modify the last requested state in one go, so changes
+		of concurrent callers to different relays don't get lost */
+	case RELAYBOARD_IOC_SET_BITS:
+		if (get_user(bits, (__u8 __user *)arg)) {
+			return -EFAULT;
+		}
+		return relayboard_change_status(file, bits, 0xff, 0);
+	case RELAYBOARD_IOC_CLEAR_BITS:
+		if (get_user(bits, (__u8 __user *)arg)) {
+			return -EFAULT;
+		}
+		return relayboard_change_status(file, bits, 0x00, 0);
+	case RELAYBOARD_IOC_TOGGLE_BITS:
+		if (get_user(bits, (__u8 __user *)arg)) {
+			return -EFAULT;
+		}
+		return relayboard_change_status(file, 0x00, 0x00, bits);
+	case RELAYBOARD_IOC_SET_MASKED:
+		if (copy_from_user(&masked, (void __user *)arg, sizeof(masked))) {
+			return -EFAULT;
+		}
+		return relayboard_change_status(file, masked.mask, masked.value, 0);
+	case RELAYBOARD_IOC_PULSE:
+		if (copy_from_user(&pulse, (void __user *)arg, sizeof(pulse))) {
+			return -EFAULT;
+		}
+		return relayboard_start_pulse(file, &pulse);
+	case RELAYBOARD_IOC_SEQ_LOAD:
+		if (copy_from_user(&seq, (void __user *)arg, sizeof(seq))) {
+			return -EFAULT;
+		}
+		return relayboard_load_sequence(dev, &seq);
+	case RELAYBOARD_IOC_SEQ_START:
+		if (get_user(mode, argp)) {
+			return -EFAULT;
+		}
+		return relayboard_start_sequence(dev, mode);
+	case RELAYBOARD_IOC_SEQ_STOP:
+		mutex_lock(&dev->seq_mutex);
+		relayboard_stop_sequence(dev);
+		mutex_unlock(&dev->seq_mutex);
 		return 0;
+	case RELAYBOARD_IOC_SEQ_STATUS:
+		relayboard_get_seq_status(dev, &seq_status);
+		return copy_to_user((void __user *)arg, &seq_status, sizeof(seq_status))
+			? -EFAULT : 0;
+	case RELAYBOARD_IOC_GROUP_SET:
+		if (copy_from_user(&group, (void __user *)arg, sizeof(group))) {
+			return -EFAULT;
+		}
+		return relayboard_group_set(&group);
+	case RELAYBOARD_IOC_READ_HW:
+		if (relayboard_lock_interruptible(dev)) {
+			return -ERESTARTSYS;
+		}
+		if (!dev->interface) {
+			relayboard_unlock(dev);
+			return -ENODEV;
+		}
+		memset(&hw, 0, sizeof(hw));
+		relayboard_start_deadline(dev);
+		result = relayboard_read_register(dev, &hw.state, &power_fail);
+		if (power_fail) {
+			hw.flags |= RELAYBOARD_HW_POWER_FAIL;
+		} else if (hw.state != dev->relay_states) {
+			hw.flags |= RELAYBOARD_HW_MISMATCH;
+		}
+		if (!result) {
+			relayboard_set_power(dev, power_fail);
+		}
+		relayboard_unlock(dev);
+		if (result) {
+			return result;
+		}
+		return copy_to_user((void __user *)arg, &hw, sizeof(hw)) ? -EFAULT : 0;
 	}
-	dev = infos->device;
-	down( &dev->mutex );
-	snprintf( state_str, sizeof(state_str), "%d\n", dev->relay_states );
-	count = strlen(state_str);
-	count -= copy_to_user(buffer,state_str,count);
-	infos->last_call = timestamp;
-	up( &dev->mutex );
-	return count;
+	return -ENOTTY;
+}
+
+/* Readable once the state changed since this file last read it, EPOLLPRI
+	once the relay supply failed or came back since it got the status */
+static __poll_t relayboard_poll(struct file *file, poll_table *wait)
+{
+	struct file_additions *infos = file->private_data;
+	struct usb_relayboard *dev = infos->device;
+	struct relayboard_status status;
+	unsigned long gen;
+	__poll_t mask = 0;
+	poll_wait(file, &dev->state_wait, wait);
+	if (!dev->interface) {
+		return EPOLLERR | EPOLLHUP;
+	}
+	relayboard_get_status(dev, &status, &gen);
+	if (infos->seen_gen != gen) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	if (infos->seen_power_gen != READ_ONCE(dev->power_gen)) {
+		mask |= EPOLLPRI;
+	}
+	/* Writes are never refused, they only replace the target state */
+	return mask | EPOLLOUT | EPOLLWRNORM;
+}
+
+/*
+ * Background writing
+ */
+
+/* Get the state of the board and the one on its way. This never waits for 
+	a write, not even for the queue lock */
+static void relayboard_get_status(struct usb_relayboard *dev,
+			  struct relayboard_status *status, unsigned long *gen)
+{
+	unsigned int seq;
+	memset(status, 0, sizeof(*status));
+	do {
+		seq = read_seqcount_begin(&dev->state_seq);
+		status->state = dev->relay_states;
+		if (dev->queue_busy) {
+			status->pending = dev->target_state;
+			status->flags = RELAYBOARD_STATUS_BUSY;
+		} else {
+			status->pending = dev->relay_states;
+			status->flags = 0;
+		}
+		if (READ_ONCE(dev->pulse_state) != RELAY_PULSE_IDLE) {
+			status->flags |= RELAYBOARD_STATUS_PULSE;
+		}
+		if (READ_ONCE(dev->seq_running)) {
+			status->flags |= RELAYBOARD_STATUS_SEQUENCE;
+		}
+		status->flags |= dev->verify_flags;
+		if (dev->power_fail) {
+			status->flags |= RELAYBOARD_STATUS_POWER_FAIL;
+		}
+		if (dev->last_failed) {
+			status->flags |= RELAYBOARD_STATUS_FAILED;
+			status->frames_done = dev->frames_done;
+			status->frames_total = dev->frames_total;
+		}
+		if (gen) {
+			*gen = dev->state_gen;
+		}
+	} while (read_seqcount_retry(&dev->state_seq, seq));
+}
+
+/* Apply a change to the state the board should show next, gen is set to 
+	the generation to wait for. Called with queue_lock held, returns if 
+	there is anything to send, idle tells if the work has to be started */
+static bool __relayboard_queue_status(struct usb_relayboard *dev, __u8 mask,
+			  __u8 status, __u8 flip, unsigned long *gen, bool *idle)
+{
+	status = (((dev->queue_busy ? dev->target_state : dev->relay_states) & ~mask)
+		| (status & mask)) ^ flip;
+	*idle = false;
+	if (!dev->queue_busy && status == dev->relay_states) {
+		atomic64_inc(&dev->stats.noop_writes);
+		*gen = dev->ok_gen;
+		return false;
+	}
+	relayboard_state_begin(dev);
+	dev->target_state = status;
+	*idle = !dev->queue_busy;
+	dev->queue_busy = true;
+	relayboard_state_end(dev);
+	dev->target_pending = true;
+	*gen = ++dev->queued_gen;
+	return true;
+}
+
+/* Changes of the state readers see, made with queue_lock held. The end 
+	also copies them to the status page */
+static void relayboard_state_begin(struct usb_relayboard *dev)
+{
+	write_seqcount_begin(&dev->state_seq);
+}
+
+static void relayboard_state_end(struct usb_relayboard *dev)
+{
+	struct relayboard_shared *shared = dev->shared;
+	WRITE_ONCE(shared->seq, shared->seq + 1);
+	smp_wmb();
+	shared->state = dev->relay_states;
+	shared->pending = dev->queue_busy ? dev->target_state : dev->relay_states;
+	shared->flags = (dev->queue_busy ? RELAYBOARD_STATUS_BUSY : 0)
+		| (dev->last_failed ? RELAYBOARD_STATUS_FAILED : 0) | dev->verify_flags
+		| (dev->power_fail ? RELAYBOARD_STATUS_POWER_FAIL : 0);
+	shared->gen = dev->state_gen;
+	shared->update_ns = ktime_get_ns();
+	shared->error = dev->last_failed ? dev->last_error : 0;
+	shared->frames_done = dev->last_failed ? dev->frames_done : 0;
+	shared->frames_total = dev->last_failed ? dev->frames_total : 0;
+	smp_wmb();
+	WRITE_ONCE(shared->seq, shared->seq + 1);
+	write_seqcount_end(&dev->state_seq);
+}
+
+static void relayboard_kick_work(struct usb_relayboard *dev)
+{
+	/* Each scheduled run of the work holds a reference on the device */
+	kref_get(&dev->kref);
+	if (!queue_work(system_highpri_wq, &dev->write_work)) {
+		kref_put(&dev->kref, relayboard_free);
+	}
+}
+
+/* Make the relays in mask show the values in status and toggle the relays
+	in flip with the next state the board gets, gen is set to the generation
+	to wait for. The other relays keep the state the last write asked for. 
+	If the board already shows the resulting state and nothing is on its 
+	way, there is nothing to send at all */
+static int relayboard_queue_status(struct usb_relayboard *dev, __u8 mask,
+			  __u8 status, __u8 flip, unsigned long *gen)
+{
+	unsigned long flags;
+	bool idle;
+	if (!dev->interface) {
+		return -ENODEV;
+	}
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	__relayboard_queue_status(dev, mask, status, flip, gen, &idle);
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	if (idle) {
+		relayboard_kick_work(dev);
+	}
+	return 0;
+}
+
+static bool relayboard_gen_done(struct usb_relayboard *dev, unsigned long gen)
+{
+	unsigned long flags;
+	bool done;
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	done = (long)(dev->done_gen - gen) >= 0;
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	return done;
+}
+
+/* Wait for the board, at most timeout_ms if that isn't 0. The state stays
+	queued if the wait ends early */
+static int relayboard_wait_event(struct usb_relayboard *dev, 
+			  unsigned int timeout_ms, bool (*done)(struct usb_relayboard *dev,
+			  unsigned long gen), unsigned long gen)
+{
+	long result;
+	if (!timeout_ms) {
+		return wait_event_interruptible(dev->queue_wait, done(dev, gen));
+	}
+	result = wait_event_interruptible_timeout(dev->queue_wait, done(dev, gen),
+		msecs_to_jiffies(timeout_ms));
+	if (result < 0) {
+		return result;
+	}
+	return result ? 0 : -ETIMEDOUT;
+}
+
+/* Wait until the work handled generation gen. That's a success if that
+	state or any newer one reached the board, a state overwritten by a 
+	later write before it was sent counts as done. The state is queued 
+	already, so a signal ends the wait with EINTR, restarting the call 
+	would queue the change a second time */
+static int relayboard_wait_status(struct usb_relayboard *dev, unsigned long gen,
+			  unsigned int timeout_ms, errseq_t *since)
+{
+	unsigned long flags;
+	int result;
+	result = relayboard_wait_event(dev, timeout_ms, relayboard_gen_done, gen);
+	if (result == -ERESTARTSYS) {
+		return -EINTR;
+	}
+	if (result) {
+		return result;
+	}
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	result = (long)(dev->ok_gen - gen) >= 0 ? 0 : dev->last_error;
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	/* Reported to the file here, so it doesn't get it again on fsync */
+	if (result && since) {
+		errseq_check_and_advance(&dev->queue_errseq, since);
+	}
+	return result;
+}
+
+static bool relayboard_queue_idle(struct usb_relayboard *dev,
+			  unsigned long gen)
+{
+	unsigned long flags;
+	bool busy;
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	busy = dev->queue_busy;
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	return !busy;
+}
+
+static int relayboard_wait_queue(struct usb_relayboard *dev,
+			  unsigned int timeout_ms)
+{
+	return relayboard_wait_event(dev, timeout_ms, relayboard_queue_idle, 0);
+}
+
+static void relayboard_write_work(struct work_struct *work)
+{
+	struct usb_relayboard *dev = container_of(work, struct usb_relayboard,
+		write_work);
+	unsigned long flags;
+	unsigned long gen;
+	__u8 status;
+	int result;
+	relayboard_lock(dev);
+	for (;;) {
+		spin_lock_irqsave(&dev->queue_lock, flags);
+		if (!dev->target_pending) {
+			relayboard_state_begin(dev);
+			dev->queue_busy = false;
+			relayboard_state_end(dev);
+			spin_unlock_irqrestore(&dev->queue_lock, flags);
+			break;
+		}
+		status = dev->target_state;
+		gen = dev->queued_gen;
+		dev->target_pending = false;
+		spin_unlock_irqrestore(&dev->queue_lock, flags);
+		/* Writes may have gone back to what the board shows already, if the
+			board is gone drop what's left */
+		if (!dev->interface) {
+			result = -ENODEV;
+		} else if (status == dev->relay_states) {
+			atomic64_inc(&dev->stats.noop_writes);
+			result = 0;
+		} else {
+			result = relayboard_send_status(dev, status);
+		}
+		spin_lock_irqsave(&dev->queue_lock, flags);
+		dev->done_gen = gen;
+		relayboard_pulse_started(dev, gen, result);
+		if (result) {
+			dev->last_error = result;
+			/* Kept until the fsync of every open file reports it */
+			errseq_set(&dev->queue_errseq, result);
+		} else {
+			dev->ok_gen = gen;
+		}
+		relayboard_state_begin(dev);
+		dev->last_failed = result != 0;
+		relayboard_state_end(dev);
+		spin_unlock_irqrestore(&dev->queue_lock, flags);
+		wake_up_interruptible_all(&dev->queue_wait);
+	}
+	relayboard_unlock(dev);
+	wake_up_interruptible_all(&dev->queue_wait);
+	kref_put(&dev->kref, relayboard_free);
+}
+
+/*
+ * Timed pulses
+ */
+
+/* Switch the relays in the mask on and off again after the given time. The
+	time counts from the latch switching them on, the board gets the state 
+	switching them off early by the time a state change takes, so the relays
+	are on for the time asked for and not for that plus a shift-out */
+static int relayboard_start_pulse(struct file *file,
+			  const struct relayboard_pulse *pulse)
+{
+	struct file_additions *infos = file->private_data;
+	struct usb_relayboard *dev = infos->device;
+	unsigned long flags;
+	unsigned long gen;
+	bool queued, idle;
+	if (!pulse->mask || !pulse->width_us) {
+		return -EINVAL;
+	}
+	/* Under queue_lock, so the timer can't start after disconnect 
+		cancelled it */
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	if (!dev->interface) {
+		spin_unlock_irqrestore(&dev->queue_lock, flags);
+		return -ENODEV;
+	}
+	if (dev->pulse_state != RELAY_PULSE_IDLE) {
+		spin_unlock_irqrestore(&dev->queue_lock, flags);
+		return -EBUSY;
+	}
+	dev->pulse_mask = pulse->mask;
+	dev->pulse_width = (s64)pulse->width_us * NSEC_PER_USEC;
+	queued = __relayboard_queue_status(dev, pulse->mask, 0xff, 0, &gen, &idle);
+	if (queued) {
+		dev->pulse_gen = gen;
+		WRITE_ONCE(dev->pulse_state, RELAY_PULSE_STARTING);
+	} else {
+		/* They are on already, so the time starts now */
+		WRITE_ONCE(dev->pulse_state, RELAY_PULSE_RUNNING);
+		hrtimer_start(&dev->pulse_timer, ktime_add_ns(ktime_get(),
+			max_t(s64, dev->pulse_width - dev->shift_ns, 0)), HRTIMER_MODE_ABS);
+	}
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	if (idle) {
+		relayboard_kick_work(dev);
+	}
+	if (!queued || (file->f_flags & O_NONBLOCK)) {
+		return 0;
+	}
+	return relayboard_wait_status(dev, gen, infos->timeout_ms,
+		&infos->err_since);
+}
+
+/* Called by the write work with queue_lock held for each generation it 
+	handled, starts the pulse timer once the relays switched on */
+static void relayboard_pulse_started(struct usb_relayboard *dev,
+			  unsigned long gen, int result)
+{
+	if (dev->pulse_state != RELAY_PULSE_STARTING
+		|| (long)(gen - dev->pulse_gen) < 0) {
+		return;
+	}
+	/* If they didn't switch on, there's nothing to switch off either */
+	if (result) {
+		WRITE_ONCE(dev->pulse_state, RELAY_PULSE_IDLE);
+		return;
+	}
+	WRITE_ONCE(dev->pulse_state, RELAY_PULSE_RUNNING);
+	hrtimer_start(&dev->pulse_timer, ktime_add_ns(dev->latch_time,
+		max_t(s64, dev->pulse_width - dev->shift_ns, 0)), HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart relayboard_pulse_timer(struct hrtimer *timer)
+{
+	struct usb_relayboard *dev = container_of(timer, struct usb_relayboard,
+		pulse_timer);
+	/* Sending has to sleep, so the state is queued from a work */
+	queue_work(system_highpri_wq, &dev->pulse_work);
+	return HRTIMER_NORESTART;
+}
+
+static void relayboard_pulse_work(struct work_struct *work)
+{
+	struct usb_relayboard *dev = container_of(work, struct usb_relayboard,
+		pulse_work);
+	unsigned long flags;
+	unsigned long gen;
+	bool idle = false;
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	if (dev->interface) {
+		__relayboard_queue_status(dev, dev->pulse_mask, 0x00, 0, &gen, &idle);
+	}
+	WRITE_ONCE(dev->pulse_state, RELAY_PULSE_IDLE);
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	if (idle) {
+		relayboard_kick_work(dev);
+	}
+}
+
+/*
+ * Sequences
+ */
+
+/* Replace the loaded sequence, not while it plays */
+static int relayboard_load_sequence(struct usb_relayboard *dev,
+			  const struct relayboard_sequence *seq)
+{
+	struct relayboard_step *steps, *old;
+	unsigned long flags;
+	if (!seq->count || seq->count > RELAY_SEQ_MAX_STEPS || seq->reserved) {
+		return -EINVAL;
+	}
+	steps = kvmalloc_array(seq->count, sizeof(*steps), GFP_KERNEL);
+	if (!steps) {
+		return -ENOMEM;
+	}
+	if (copy_from_user(steps, u64_to_user_ptr(seq->steps),
+			seq->count * sizeof(*steps))) {
+		kvfree(steps);
+		return -EFAULT;
+	}
+	mutex_lock(&dev->seq_mutex);
+	if (dev->seq_running) {
+		mutex_unlock(&dev->seq_mutex);
+		kvfree(steps);
+		return -EBUSY;
+	}
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	old = dev->seq_steps;
+	dev->seq_steps = steps;
+	dev->seq_count = seq->count;
+	dev->seq_step = 0;
+	dev->seq_loops = 0;
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	mutex_unlock(&dev->seq_mutex);
+	kvfree(old);
+	return 0;
+}
+
+/* Play the loaded sequence from its first step, the first delta counts from
+	now */
+static int relayboard_start_sequence(struct usb_relayboard *dev, __u32 flags)
+{
+	unsigned long lock_flags;
+	u64 length = 0;
+	unsigned int i;
+	int result = 0;
+	if (flags & ~RELAYBOARD_SEQ_LOOP) {
+		return -EINVAL;
+	}
+	mutex_lock(&dev->seq_mutex);
+	if (!dev->interface) {
+		result = -ENODEV;
+	} else if (!dev->seq_steps) {
+		result = -ENODATA;
+	} else if (dev->seq_running) {
+		result = -EBUSY;
+	}
+	if (result) {
+		mutex_unlock(&dev->seq_mutex);
+		return result;
+	}
+	/* A loop taking next to no time would keep the timer and the work 
+		busy all the time */
+	for (i = 0; i < dev->seq_count; i++) {
+		length += dev->seq_steps[i].delta_us;
+	}
+	if ((flags & RELAYBOARD_SEQ_LOOP) && (length < RELAY_SEQ_MIN_LOOP_US
+			|| length * NSEC_PER_USEC < dev->shift_ns)) {
+		mutex_unlock(&dev->seq_mutex);
+		return -EINVAL;
+	}
+	spin_lock_irqsave(&dev->queue_lock, lock_flags);
+	dev->seq_step = 0;
+	dev->seq_loops = 0;
+	dev->seq_loop = flags & RELAYBOARD_SEQ_LOOP;
+	dev->seq_time = ktime_add_us(ktime_get(), dev->seq_steps[0].delta_us);
+	WRITE_ONCE(dev->seq_running, true);
+	hrtimer_start(&dev->seq_timer, ktime_sub_ns(dev->seq_time, dev->shift_ns),
+		HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&dev->queue_lock, lock_flags);
+	mutex_unlock(&dev->seq_mutex);
+	return 0;
+}
+
+/* Stop the playback, called with seq_mutex held. Once this returns, the
+	sequence doesn't queue any more states, the last one queued still goes 
+	out */
+static void relayboard_stop_sequence(struct usb_relayboard *dev)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	WRITE_ONCE(dev->seq_running, false);
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	/* The work doesn't restart the timer anymore */
+	hrtimer_cancel(&dev->seq_timer);
+	cancel_work_sync(&dev->seq_work);
+}
+
+static void relayboard_get_seq_status(struct usb_relayboard *dev,
+			  struct relayboard_seq_status *status)
+{
+	unsigned long flags;
+	memset(status, 0, sizeof(*status));
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	if (dev->seq_running) {
+		status->flags |= RELAYBOARD_SEQ_RUNNING;
+	}
+	if (dev->seq_loop) {
+		status->flags |= RELAYBOARD_SEQ_LOOP;
+	}
+	status->count = dev->seq_count;
+	status->step = dev->seq_step;
+	status->loops = dev->seq_loops;
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+}
+
+static enum hrtimer_restart relayboard_seq_timer(struct hrtimer *timer)
+{
+	struct usb_relayboard *dev = container_of(timer, struct usb_relayboard,
+		seq_timer);
+	queue_work(system_highpri_wq, &dev->seq_work);
+	return HRTIMER_NORESTART;
+}
+
+/* Queue the step that is due and arm the timer for the next one. Steps are
+	timed from the start of the sequence, not from each other, so a late
+	step doesn't delay the rest. Each state is queued early by the time a 
+	state change takes, like pulses do. Steps due already while the board 
+	is still busy replace each other, steps with the state of the step 
+	before send nothing */
+static void relayboard_seq_work(struct work_struct *work)
+{
+	struct usb_relayboard *dev = container_of(work, struct usb_relayboard,
+		seq_work);
+	unsigned long flags;
+	unsigned long gen;
+	bool kick = false;
+	bool idle;
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	while (dev->seq_running && dev->interface) {
+		__relayboard_queue_status(dev, 0xff, dev->seq_steps[dev->seq_step].state,
+			0, &gen, &idle);
+		kick |= idle;
+		if (++dev->seq_step == dev->seq_count) {
+			if (!dev->seq_loop) {
+				WRITE_ONCE(dev->seq_running, false);
+				break;
+			}
+			dev->seq_step = 0;
+			dev->seq_loops++;
+		}
+		dev->seq_time = ktime_add_us(dev->seq_time, 
+			dev->seq_steps[dev->seq_step].delta_us);
+		if (ktime_after(ktime_sub_ns(dev->seq_time, dev->shift_ns), ktime_get())) {
+			hrtimer_start(&dev->seq_timer, ktime_sub_ns(dev->seq_time,
+				dev->shift_ns), HRTIMER_MODE_ABS);
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	if (kick) {
+		relayboard_kick_work(dev);
+	}
+}
+
+/*
+ * Group writes
+ */
+
+/* Boards are locked in the order of their structures, so two group writes
+	sharing boards can't deadlock */
+static int relayboard_group_cmp(const void *a, const void *b)
+{
+	const struct relayboard_group_member *x = a, *y = b;
+	if (x->dev == y->dev) {
+		return 0;
+	}
+	return x->dev < y->dev ? -1 : 1;
+}
+
+/* Switch several boards at once. Each entry names a board by an open file
+	descriptor, which has to be open for writing. All boards are locked 
+	first, then their states are shifted out at the same time and only if
+	that worked everywhere, they are latched in one burst */
+static int relayboard_group_set(const struct relayboard_group *group)
+{
+	struct relayboard_group_entry *entries;
+	struct relayboard_group_member *members;
+	struct file_additions *infos;
+	struct file *file;
+	int count = group->count;
+	int locked = 0;
+	int result = 0;
+	int i;
+	if (!count || count > RELAY_GROUP_MAX || group->reserved) {
+		return -EINVAL;
+	}
+	entries = kmalloc_array(count, sizeof(*entries), GFP_KERNEL);
+	members = kcalloc(count, sizeof(*members), GFP_KERNEL);
+	if (!entries || !members) {
+		result = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(entries, u64_to_user_ptr(group->entries),
+			count * sizeof(*entries))) {
+		result = -EFAULT;
+		goto out;
+	}
+	for (i = 0; i < count; i++) {
+		entries[i].result = 0;
+		file = fget(entries[i].fd);
+		if (!file) {
+			result = -EBADF;
+			goto out;
+		}
+		members[i].file = file;
+		members[i].entry = &entries[i];
+		if (file->f_op != &relayboard_fops || !(file->f_mode & FMODE_WRITE)) {
+			result = -EBADF;
+			goto out;
+		}
+		infos = file->private_data;
+		members[i].dev = infos->device;
+	}
+	sort(members, count, sizeof(*members), relayboard_group_cmp, NULL);
+	for (i = 1; i < count; i++) {
+		if (members[i].dev == members[i - 1].dev) {
+			result = -EINVAL;
+			goto out;
+		}
+	}
+	for (; locked < count; locked++) {
+		if (relayboard_lock_interruptible(members[locked].dev)) {
+			result = -ERESTARTSYS;
+			goto unlock;
+		}
+		if (!members[locked].dev->interface) {
+			locked++;
+			result = -ENODEV;
+			goto unlock;
+		}
+	}
+	result = relayboard_group_send(members, count);
+unlock:
+	while (locked--) {
+		relayboard_unlock(members[locked].dev);
+	}
+	for (i = 0; i < count; i++) {
+		members[i].entry->result = members[i].result;
+	}
+	if (copy_to_user(u64_to_user_ptr(group->entries), entries,
+			count * sizeof(*entries))) {
+		result = result ? result : -EFAULT;
+	}
+out:
+	if (members) {
+		for (i = 0; i < count && members[i].file; i++) {
+			fput(members[i].file);
+		}
+	}
+	kfree(members);
+	kfree(entries);
+	return result;
+}
+
+/* Send the states of all members, called with all of them locked. Returns 
+	the first error, if shifting out failed anywhere nothing is latched and
+	the boards that were fine get ECANCELED */
+static int relayboard_group_send(struct relayboard_group_member *members,
+			  int count)
+{
+	struct relayboard_group_member *m;
+	struct relayboard_group_entry *entry;
+	struct usb_relayboard *dev;
+	unsigned long flags;
+	int result = 0;
+	int offset;
+	for (m = members; m < members + count; m++) {
+		dev = m->dev;
+		entry = m->entry;
+		spin_lock_irqsave(&dev->queue_lock, flags);
+		m->state = ((dev->queue_busy ? dev->target_state : dev->relay_states)
+			& ~entry->mask) | (entry->value & entry->mask);
+		spin_unlock_irqrestore(&dev->queue_lock, flags);
+		/* Boards showing that state already just sit this one out */
+		m->count = m->state == dev->relay_states ? 0 
+			: relayboard_build_frames(dev->frames, m->state, true);
+		if (!m->count) {
+			continue;
+		}
+		dev->frames_state = m->state;
+		relayboard_start_deadline(dev);
+		atomic_set(&dev->frames_sent, 0);
+		m->start = ktime_get();
+		/* Everything but the latch, all batches go out before we wait */
+		m->batched = batch && !dev->batch_rejected;
+		if (m->batched) {
+			dev->urb_error = 0;
+			m->result = relayboard_submit(dev, dev->urbs[0],
+				dev->out_pipe, dev->frames, dev->frames_dma,
+				(m->count - 1) * RELAY_CMD_LENGTH);
+		}
+	}
+	for (m = members; m < members + count; m++) {
+		if (m->count) {
+			m->result = relayboard_group_shift(m);
+			result = result ? result : m->result;
+		}
+	}
+	if (result) {
+		for (m = members; m < members + count; m++) {
+			if (m->count && !m->result) {
+				m->result = -ECANCELED;
+			} else if (m->count) {
+				relayboard_group_failed(m);
+			}
+		}
+		return result;
+	}
+	/* Then the latch frames back to back */
+	for (m = members; m < members + count; m++) {
+		if (m->count) {
+			dev = m->dev;
+			dev->urb_error = 0;
+			offset = (m->count - 1) * RELAY_CMD_LENGTH;
+			m->result = relayboard_submit(dev, dev->urbs[0],
+				dev->out_pipe, dev->frames + offset,
+				dev->frames_dma + offset, RELAY_CMD_LENGTH);
+		}
+	}
+	for (m = members; m < members + count; m++) {
+		dev = m->dev;
+		if (m->count && !m->result) {
+			m->result = relayboard_wait_urbs(dev);
+		}
+		if (m->result) {
+			printk( KERN_WARNING "abacomrelay: Group latch of state %d failed, error %d.\n",
+				m->state, m->result);
+			relayboard_group_failed(m);
+			result = result ? result : m->result;
+			continue;
+		}
+		if (m->count) {
+			relayboard_latched(dev, m->state, m->start);
+		}
+		/* Queued writes go on from the group's state for these relays, also
+			on boards which showed it already */
+		spin_lock_irqsave(&dev->queue_lock, flags);
+		if (dev->queue_busy) {
+			relayboard_state_begin(dev);
+			dev->target_state = (dev->target_state & ~m->entry->mask)
+				| (m->entry->value & m->entry->mask);
+			relayboard_state_end(dev);
+		}
+		spin_unlock_irqrestore(&dev->queue_lock, flags);
+	}
+	return result;
+}
+
+/* Record the failure of a member the way the write work does for a state 
+	change of its own, so the status, the shared page and fsync see it */
+static void relayboard_group_failed(struct relayboard_group_member *member)
+{
+	struct usb_relayboard *dev = member->dev;
+	unsigned long flags;
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	dev->last_error = member->result;
+	errseq_set(&dev->queue_errseq, member->result);
+	relayboard_state_begin(dev);
+	dev->last_failed = true;
+	dev->frames_done = min(atomic_read(&dev->frames_sent), member->count);
+	dev->frames_total = member->count;
+	relayboard_state_end(dev);
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	wake_up_interruptible_all(&dev->state_wait);
+}
+
+/* Finish shifting out the state of a member. Like 
+	relayboard_send_sequence(), a rejected batch is sent again frame by 
+	frame, which for boards without batches is all that happens */
+static int relayboard_group_shift(struct relayboard_group_member *member)
+{
+	struct usb_relayboard *dev = member->dev;
+	int result = member->result;
+	if (member->batched) {
+		if (!result) {
+			result = relayboard_wait_urbs(dev);
+		}
+		if (!relayboard_batch_refused(result)) {
+			return result;
+		}
+		return relayboard_batch_failed(dev, 0, member->count - 1, result);
+	}
+	return send_relay_frames(dev, 0, member->count - 1, 1);
+}
+
+/* Actual communication with the device and saving the status */
+static int relayboard_send_status(struct usb_relayboard *dev, __u8 status) {
+	unsigned long flags;
+	ktime_t start;
+	bool power_fail = false;
+	__u16 verify_flags;
+	unsigned int attempt;
+	__u8 old;
+	int count;
+	int result;
+	count = relayboard_build_frames(dev->frames, status, true);
+	dev->frames_state = status;
+	atomic64_inc(&dev->stats.writes);
+	trace_abacomrelay_write_start(dev->minor, status, count);
+	start = ktime_get();
+	relayboard_start_deadline(dev);
+	/* The state only latches with the last frame and every attempt shifts 
+		all 8 bits again, so whatever a failed attempt left in the register
+		is simply overwritten. All attempts share the deadline */
+	for (attempt = 0; ; attempt++) {
+		atomic_set(&dev->frames_sent, 0);
+		if (verify) {
+			result = relayboard_send_verified(dev, count, &old, &power_fail);
+		} else {
+			result = relayboard_send_sequence(dev, 0, count);
+		}
+		if (!result || attempt >= retries || relayboard_gone(result)
+			|| !relayboard_xfer_timeout(dev)) {
+			break;
+		}
+		printk( KERN_WARNING "abacomrelay: State change to %d failed after %d of %d frames, error %d, retrying.\n",
+			status, min(atomic_read(&dev->frames_sent), count), count, result);
+		atomic64_inc(&dev->stats.retries);
+		relayboard_recover(dev, result, attempt);
+	}
+	trace_abacomrelay_write_end(dev->minor, status,
+		min(atomic_read(&dev->frames_sent), count), result);
+	if (result) {
+		/* Tell how far we got, frames of a failed batch don't count */
+		spin_lock_irqsave(&dev->queue_lock, flags);
+		relayboard_state_begin(dev);
+		dev->frames_done = min(atomic_read(&dev->frames_sent), count);
+		dev->frames_total = count;
+		relayboard_state_end(dev);
+		spin_unlock_irqrestore(&dev->queue_lock, flags);
+		printk( KERN_WARNING "abacomrelay: State change to %d failed after %d of %d frames, error %d.\n",
+			status, dev->frames_done, count, result);
+		return result;
+	}
+	if (verify) {
+		/* The register should have held what the last state change latched */
+		verify_flags = !power_fail && old != dev->relay_states 
+			? RELAYBOARD_STATUS_MISMATCH : 0;
+		if (verify_flags && !dev->verify_flags) {
+			printk( KERN_WARNING "abacomrelay: Board lost its state before state change to %d.\n",
+				status);
+		}
+		spin_lock_irqsave(&dev->queue_lock, flags);
+		relayboard_state_begin(dev);
+		dev->verify_flags = verify_flags;
+		relayboard_state_end(dev);
+		spin_unlock_irqrestore(&dev->queue_lock, flags);
+		relayboard_set_power(dev, power_fail);
+	}
+	relayboard_latched(dev, status, start);
+	return 0;
+}
+
+/*
+ * Relay supply
+ */
+
+/* Note a change of the relay supply, called with dev->mutex held */
+static void relayboard_set_power(struct usb_relayboard *dev, bool power_fail) {
+	unsigned long flags;
+	if (power_fail == dev->power_fail) {
+		return;
+	}
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	relayboard_state_begin(dev);
+	WRITE_ONCE(dev->power_fail, power_fail);
+	WRITE_ONCE(dev->power_gen, dev->power_gen + 1);
+	relayboard_state_end(dev);
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	printk( KERN_WARNING "abacomrelay: Relay supply %s.\n",
+		power_fail ? "lost" : "restored");
+	wake_up_interruptible_all(&dev->state_wait);
+	if (dev->interface) {
+		sysfs_notify(&dev->interface->dev.kobj, NULL, "power_fail");
+	}
+}
+
+/* Tell from one input read if the relays have supply. With supply, D7 shows
+	the register's MSB (relay 8) and PFT the output of relay 1, which is low
+	while that relay is on. Without supply both read high, like getRelays()
+	in usblrb.py assumes. Returns false if the read can't tell, because the
+	state makes both high anyway or the lines show something else */
+static bool relayboard_power_state(__u8 state, __u8 input, bool *power_fail) {
+	__u8 expected = (state & 0x80 ? RELAY_PIN_READ : 0)
+		| (state & 0x01 ? 0 : RELAY_PIN_PFT);
+	input &= RELAY_PIN_READ | RELAY_PIN_PFT;
+	if (expected == (RELAY_PIN_READ | RELAY_PIN_PFT)) {
+		return false;
+	}
+	if (input == expected) {
+		*power_fail = false;
+		return true;
+	}
+	if (input == (RELAY_PIN_READ | RELAY_PIN_PFT)) {
+		*power_fail = true;
+		return true;
+	}
+	return false;
+}
+
+/* Background check of the relay supply, one input read every monitor_ms. A 
+	board busy with a write is left alone until the next time. When the 
+	supply comes back, the board gets its state again, in case the register
+	lost it meanwhile */
+static void relayboard_monitor_work(struct work_struct *work)
+{
+	struct usb_relayboard *dev = container_of(to_delayed_work(work),
+		struct usb_relayboard, monitor_work);
+	unsigned int interval;
+	bool power_fail;
+	__u8 input;
+	if (relayboard_trylock(dev)) {
+		if (!dev->interface) {
+			relayboard_unlock(dev);
+			return;
+		}
+		relayboard_start_deadline(dev);
+		/* After a failed write the register holds something half shifted */
+		if (!dev->last_failed && !relayboard_read_input(dev, &input)
+			&& relayboard_power_state(dev->relay_states, input, &power_fail)) {
+			if (dev->power_fail && !power_fail) {
+				relayboard_set_power(dev, power_fail);
+				relayboard_send_status(dev, dev->relay_states);
+			} else {
+				relayboard_set_power(dev, power_fail);
+			}
+		}
+		relayboard_unlock(dev);
+	}
+	interval = READ_ONCE(monitor_ms);
+	if (interval) {
+		queue_delayed_work(system_wq, &dev->monitor_work,
+			msecs_to_jiffies(interval));
+	}
+}
+
+/* Remember the status the board latched, start is when sending it began */
+static void relayboard_latched(struct usb_relayboard *dev, __u8 status,
+			  ktime_t start)
+{
+	unsigned long flags;
+	s64 shift_ns;
+	spin_lock_irqsave(&dev->queue_lock, flags);
+	dev->latch_time = ktime_get();
+	shift_ns = ktime_to_ns(ktime_sub(dev->latch_time, start));
+	dev->shift_ns = dev->shift_ns ? (3 * dev->shift_ns + shift_ns) / 4 : shift_ns;
+	trace_abacomrelay_write_latch(dev->minor, status, shift_ns);
+	relayboard_hist_add(dev->stats.write_hist, shift_ns);
+	if (dev->relay_states != status) {
+		relayboard_state_begin(dev);
+		dev->relay_states = status;
+		dev->state_gen++;
+		relayboard_state_end(dev);
+	}
+	spin_unlock_irqrestore(&dev->queue_lock, flags);
+	wake_up_interruptible_all(&dev->state_wait);
+}
+
+/* Read the A6275 shift register back through its serial output on D7, the
+	same way getRelays() in usblrb.py does. Clocking the bits out empties 
+	the register, so its contents are shifted in again afterwards, without
+	a latch the relays don't notice any of this */
+static int relayboard_read_register(struct usb_relayboard *dev, __u8 *state,
+				 bool *power_fail) {
+	static const char pins[] = { 0x00, RELAY_PIN_CLK, 0x00 };
+	__u8 input = 0;
+	__u8 result = 0;
+	int count, i;
+	int error;
+	relayboard_fill_frames(dev->frames, pins, sizeof(pins));
+	dev->frames_state = dev->relay_states;
+	/* All lines low */
+	error = relayboard_send_sequence(dev, 0, 1);
+	for (i = 0; i < 8 && !error; i++) {
+		error = relayboard_read_input(dev, &input);
+		if (error) {
+			break;
+		}
+		if (input & RELAY_PIN_READ) {
+			result |= 0x80 >> i;
+		}
+		/* Clock pulse for the next bit */
+		error = relayboard_send_sequence(dev, 1, 2);
+	}
+	if (error) {
+		return error;
+	}
+	/* Without relay supply the register reads all ones and PFT is set */
+	*power_fail = result == 0xff && (input & RELAY_PIN_PFT);
+	*state = result;
+	if (*power_fail) {
+		return 0;
+	}
+	count = relayboard_build_frames(dev->frames, result, false);
+	dev->frames_state = result;
+	return relayboard_send_sequence(dev, 0, count);
+}
+
+/* Fill the frame sequence which shifts out the given status and latches it
+	if latch is set, returns the number of frames */
+static int relayboard_build_frames(char *frames, __u8 status, bool latch) {
+	char pins[RELAY_FRAME_COUNT];
+	int count = 0;
+	__u8 mask, data;
+	if (compact_frames) {
+		/* The A6275 takes DATA on the rising CLK, so DATA is set with CLK low
+			one frame before and CLK may fall together with the change to the
+			next bit. The first frame takes LATCH low before anything is 
+			clocked, the last one raises it or, without latch, takes CLK low 
+			again. No frame repeats the one before */
+		for (mask = 128; mask > 0; mask >>= 1) {
+			data = status & mask ? RELAY_PIN_DATA : 0x00;
+			pins[count++] = data;
+			pins[count++] = data | RELAY_PIN_CLK;
+		}
+		pins[count++] = latch ? RELAY_PIN_LATCH : 0x00;
+		relayboard_fill_frames(frames, pins, count);
+		return count;
+	}
+	/* Start the command frame */
+	pins[count++] = 0x00;
+	for (mask = 128; mask > 0; mask >>= 1) {
+		if (status & mask) {
+			/* "relay on" */
+			pins[count++] = RELAY_PIN_DATA;
+			pins[count++] = RELAY_PIN_DATA | RELAY_PIN_CLK;
+			pins[count++] = RELAY_PIN_DATA;
+		} else {
+			/* "relay off" */
+			pins[count++] = 0x00;
+			pins[count++] = RELAY_PIN_CLK;
+			pins[count++] = 0x00;
+		}
+	}
+	/* End the command frame */
+	pins[count++] = 0x00;
+	if (latch) {
+		pins[count++] = RELAY_PIN_LATCH;
+	}
+	relayboard_fill_frames(frames, pins, count);
+	return count;
+}
+
+/* Turn a list of pin states into RELAY_CMD frames */
+static void relayboard_fill_frames(char *frames, const char *pins, int count) {
+	static const char cmd_template[] = RELAY_CMD(0x00);
+	int i;
+	for (i = 0; i < count; i++) {
+		memcpy(frames + i * RELAY_CMD_LENGTH, cmd_template, RELAY_CMD_LENGTH);
+		frames[i * RELAY_CMD_LENGTH + RELAY_CMD_DATA_OFFSET] = pins[i];
+	}
+}
+
+/* Send count frames of the transfer buffer starting at frame first. Try to
+	get all of them out in one transfer, frame sequences only latch with 
+	their last frame, so after a failed attempt it is safe to send all of
+	them again frame by frame */
+static int relayboard_send_sequence(struct usb_relayboard *dev, int first,
+				 int count) {
+	int result;
+	if (batch && !dev->batch_rejected) {
+		result = send_relay_frames(dev, first, count, count);
+		if (!relayboard_batch_refused(result)) {
+			return result;
+		}
+		return relayboard_batch_failed(dev, first, count, result);
+	}
+	return send_relay_frames(dev, first, count, 1);
+}
+
+/* A batch of count frames starting at frame first failed with error. A 
+	glitch shouldn't cost the batches for good, so after recovering the 
+	batch gets another try. Only if that fails as well while the frames get
+	through one by one, the board is taken to refuse batches */
+static int relayboard_batch_failed(struct usb_relayboard *dev, int first,
+			  int count, int error) {
+	int result;
+	relayboard_recover(dev, error, 0);
+	result = send_relay_frames(dev, first, count, count);
+	if (!relayboard_batch_refused(result)) {
+		return result;
+	}
+	relayboard_recover(dev, result, 0);
+	result = send_relay_frames(dev, first, count, 1);
+	if (!result) {
+		printk( KERN_WARNING "abacomrelay: Batched transfer rejected (error %d), falling back to single frames.\n",
+			error);
+		dev->batch_rejected = true;
+	}
+	return result;
+}
+
+/* Batches of frames cross the packet boundaries of the bulk endpoint, a 
+	CH341 parsing each packet on its own would garble them without any USB
+	error. So once, while probing, a state is shifted in one batch without
+	a latch and read back, single frames are used from then on if it 
+	doesn't come back. Without relay supply there is nothing to read, the
+	batches stay on then */
+static void relayboard_check_batch(struct usb_relayboard *dev) {
+	static const __u8 pattern = 0xa5;
+	bool power_fail = false;
+	__u8 state;
+	int count;
+	int result;
+	if (!batch) {
+		return;
+	}
+	count = relayboard_build_frames(dev->frames, pattern, false);
+	dev->frames_state = pattern;
+	relayboard_start_deadline(dev);
+	result = send_relay_frames(dev, 0, count, count);
+	if (relayboard_batch_refused(result)) {
+		/* Takes the batches away if single frames get through instead */
+		result = relayboard_batch_failed(dev, 0, count, result);
+	}
+	if (!result) {
+		result = relayboard_read_register(dev, &state, &power_fail);
+	}
+	if (!result && !power_fail && !dev->batch_rejected && state != pattern) {
+		printk( KERN_WARNING "abacomrelay: Board garbles batched frames (read back %d instead of %d), using single frames.\n",
+			state, pattern);
+		dev->batch_rejected = true;
+	}
+	/* Whatever came of it, the register holds the pattern now. Without a
+		latch the relays never saw it, but the next read back or verified
+		write would, so the remembered state is shifted in again */
+	count = relayboard_build_frames(dev->frames, dev->relay_states, false);
+	dev->frames_state = dev->relay_states;
+	relayboard_send_sequence(dev, 0, count);
+}
+
+/* The board or the host controller went away, no retry can help */
+static bool relayboard_gone(int error) {
+	return error == -ENODEV || error == -ESHUTDOWN;
+}
+
+/* A batch failing like this may have been refused by the board, frames 
+	sent singly might get through. Running out of time is no reason to give
+	up on batches */
+static bool relayboard_batch_refused(int error) {
+	return error && error != -ETIMEDOUT && !relayboard_gone(error);
+}
+
+/* Get the endpoints working again after a failed transfer. A stall stays
+	until it is cleared, anything else gets a pause first, which grows with
+	each further attempt */
+static void relayboard_recover(struct usb_relayboard *dev, int error,
+			  unsigned int attempt) {
+	if (error == -EPIPE) {
+		/* We don't know which one it was, clearing both is cheap */
+		usb_clear_halt(dev->udev, dev->out_pipe);
+		usb_clear_halt(dev->udev, dev->in_pipe);
+		atomic64_inc(&dev->stats.halts_cleared);
+		return;
+	}
+	if (retry_delay_ms) {
+		msleep(retry_delay_ms << min(attempt, 8U));
+	}
+}
+
+/* Ask the CH341 for the state of its D0..D7 lines */
+static int relayboard_read_input(struct usb_relayboard *dev, __u8 *input) {
+	int result;
+	dev->urb_error = 0;
+	/* Queue the read first, so the answer is picked up right away */
+	result = relayboard_submit(dev, dev->urbs[1], dev->in_pipe,
+		dev->io + RELAY_IO_INPUT, dev->io_dma + RELAY_IO_INPUT,
+		RELAY_INPUT_LENGTH);
+	if (!result) {
+		result = relayboard_submit(dev, dev->urbs[0], dev->out_pipe,
+			dev->io + RELAY_IO_CMD, dev->io_dma + RELAY_IO_CMD, 1);
+	}
+	if (result) {
+		usb_kill_anchored_urbs(&dev->submitted);
+		return result;
+	}
+	result = relayboard_wait_urbs(dev);
+	if (result) {
+		return result;
+	}
+	*input = dev->io[RELAY_IO_INPUT];
+	return 0;
+}
+
+/* Index of the first frame a transfer carries, -1 for the input buffer */
+static int relayboard_urb_frame(struct usb_relayboard *dev, const char *buffer)
+{
+	if (buffer < dev->frames || buffer >= dev->frames + RELAY_SEQ_LENGTH) {
+		return -1;
+	}
+	return (buffer - dev->frames) / RELAY_CMD_LENGTH;
+}
+
+/* Slot of an urb in dev->urbs */
+static int relayboard_urb_index(struct usb_relayboard *dev, struct urb *urb)
+{
+	int i;
+	for (i = 0; i < RELAY_URB_COUNT - 1 && dev->urbs[i] != urb; i++);
+	return i;
+}
+
+/* Send the frame sequence in the transfer buffer and read the serial out 
+	of the A6275 before every rising CLK. While the new state shifts in, 
+	the old register contents come out there bit by bit, MSB first, so that
+	is what the register held before, and the PFT line tells if the relays
+	have supply. Costs one input read per bit on top of the frames */
+static int relayboard_send_verified(struct usb_relayboard *dev, int count,
+			  __u8 *old, bool *power_fail)
+{
+	const char *pins = dev->frames + RELAY_CMD_DATA_OFFSET;
+	__u8 input = 0;
+	__u8 value = 0;
+	int first = 0;
+	int bit = 0;
+	int result;
+	int i;
+	for (i = 1; i < count && bit < 8; i++) {
+		if (!(pins[i * RELAY_CMD_LENGTH] & RELAY_PIN_CLK)
+			|| (pins[(i - 1) * RELAY_CMD_LENGTH] & RELAY_PIN_CLK)) {
+			continue;
+		}
+		result = relayboard_shift_and_read(dev, first, i - first, &input);
+		if (result) {
+			return result;
+		}
+		if (input & RELAY_PIN_READ) {
+			value |= 0x80 >> bit;
+		}
+		bit++;
+		first = i;
+	}
+	/* Without relay supply the register reads all ones and PFT is set */
+	*power_fail = value == 0xff && (input & RELAY_PIN_PFT);
+	*old = value;
+	return relayboard_send_sequence(dev, first, count - first);
+}
+
+/* Send count frames starting at frame first and read the input lines after
+	them, with batches all in one go: the read is queued on the IN endpoint 
+	first, the frames and the read command follow in order on the OUT one */
+static int relayboard_shift_and_read(struct usb_relayboard *dev, int first,
+			  int count, __u8 *input)
+{
+	int offset = first * RELAY_CMD_LENGTH;
+	int result;
+	if (!batch || dev->batch_rejected) {
+		result = relayboard_send_sequence(dev, first, count);
+		return result ? result : relayboard_read_input(dev, input);
+	}
+	dev->urb_error = 0;
+	result = relayboard_submit(dev, dev->urbs[RELAY_URB_COUNT - 1], dev->in_pipe,
+		dev->io + RELAY_IO_INPUT, dev->io_dma + RELAY_IO_INPUT,
+		RELAY_INPUT_LENGTH);
+	if (!result) {
+		result = relayboard_submit(dev, dev->urbs[0], dev->out_pipe,
+			dev->frames + offset, dev->frames_dma + offset,
+			count * RELAY_CMD_LENGTH);
+	}
+	if (!result) {
+		result = relayboard_submit(dev, dev->urbs[RELAY_URB_COUNT - 2],
+			dev->out_pipe, dev->io + RELAY_IO_CMD, dev->io_dma + RELAY_IO_CMD, 1);
+	}
+	if (result) {
+		usb_kill_anchored_urbs(&dev->submitted);
+	} else {
+		result = relayboard_wait_urbs(dev);
+	}
+	if (relayboard_batch_refused(result)) {
+		/* The same way as relayboard_send_sequence() gives the batch up, the
+			read follows on its own then */
+		result = relayboard_batch_failed(dev, first, count, result);
+		return result ? result : relayboard_read_input(dev, input);
+	}
+	if (result) {
+		return result;
+	}
+	*input = dev->io[RELAY_IO_INPUT];
+	return 0;
+}
+
+static void relayboard_urb_complete(struct urb *urb)
+{
+	struct usb_relayboard *dev = urb->context;
+	trace_abacomrelay_frame_complete(dev->minor, dev->frames_state,
+		relayboard_urb_frame(dev, urb->transfer_buffer), urb->status,
+		urb->actual_length);
+	relayboard_hist_add(dev->stats.xfer_hist, ktime_to_ns(ktime_sub(ktime_get(),
+		dev->urb_start[relayboard_urb_index(dev, urb)])));
+	if (urb->status) {
+		atomic64_inc(&dev->stats.bulk_errors);
+	} else if (usb_pipeout(urb->pipe) 
+			? urb->actual_length != urb->transfer_buffer_length
+			: !urb->actual_length) {
+		atomic64_inc(&dev->stats.short_xfers);
+	}
+	/* Frames have to get out completely, the CH341 may answer shorter
+		than asked for. Only the first error counts, the ones of urbs killed
+		because of it don't */
+	if (urb->status) {
+		cmpxchg(&dev->urb_error, 0, urb->status);
+	} else if (usb_pipeout(urb->pipe) 
+			? urb->actual_length != urb->transfer_buffer_length
+			: !urb->actual_length) {
+		cmpxchg(&dev->urb_error, 0, -EIO);
+	} else if (urb->transfer_buffer_length % RELAY_CMD_LENGTH == 0) {
+		atomic_add(urb->transfer_buffer_length / RELAY_CMD_LENGTH, 
+			&dev->frames_sent);
+		atomic64_add(urb->transfer_buffer_length / RELAY_CMD_LENGTH,
+			&dev->stats.frames);
+	}
+	atomic_dec(&dev->urbs_busy);
+	wake_up(&dev->urb_wait);
+}
+
+/* Submit a bulk transfer of length bytes from our coherent buffers */
+static int relayboard_submit(struct usb_relayboard *dev, struct urb *urb,
+				 unsigned int pipe, char *buffer, dma_addr_t dma, int length) {
+	int result;
+	usb_fill_bulk_urb(urb, dev->udev, pipe, buffer, length,
+		relayboard_urb_complete, dev);
+	urb->transfer_dma = dma;
+	trace_abacomrelay_frame_submit(dev->minor, dev->frames_state,
+		relayboard_urb_frame(dev, buffer), length / RELAY_CMD_LENGTH);
+	usb_anchor_urb(urb, &dev->submitted);
+	atomic_inc(&dev->urbs_busy);
+	dev->urb_start[relayboard_urb_index(dev, urb)] = ktime_get();
+	result = usb_submit_urb(urb, GFP_KERNEL);
+	if (result) {
+		usb_unanchor_urb(urb);
+		atomic_dec(&dev->urbs_busy);
+	}
+	return result;
+}
+
+/* Every state change or read-back has deadline_ms to complete */
+static void relayboard_start_deadline(struct usb_relayboard *dev) {
+	dev->deadline = deadline_ms ? jiffies + msecs_to_jiffies(deadline_ms) : 0;
+}
+
+/* dev->mutex serialises everything talking to the board */
+static void relayboard_lock(struct usb_relayboard *dev) {
+	ktime_t start = ktime_get();
+	down( &dev->mutex );
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		&dev->stats.lock_wait_ns);
+	trace_abacomrelay_lock_acquire(dev->minor);
+}
+
+static int relayboard_lock_interruptible(struct usb_relayboard *dev) {
+	ktime_t start = ktime_get();
+	if (down_interruptible( &dev->mutex )) {
+		return -ERESTARTSYS;
+	}
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		&dev->stats.lock_wait_ns);
+	trace_abacomrelay_lock_acquire(dev->minor);
+	return 0;
+}
+
+static bool relayboard_trylock(struct usb_relayboard *dev) {
+	if (down_trylock( &dev->mutex )) {
+		return false;
+	}
+	trace_abacomrelay_lock_acquire(dev->minor);
+	return true;
+}
+
+static void relayboard_unlock(struct usb_relayboard *dev) {
+	trace_abacomrelay_lock_release(dev->minor);
+	up( &dev->mutex );
+}
+
+/* Time the next wait for a transfer may take, 0 if the deadline passed */
+static unsigned long relayboard_xfer_timeout(struct usb_relayboard *dev) {
+	unsigned long timeout = msecs_to_jiffies(xfer_timeout_ms);
+	if (dev->deadline) {
+		if (!time_before(jiffies, dev->deadline)) {
+			return 0;
+		}
+		timeout = min(timeout, dev->deadline - jiffies);
+	}
+	return timeout;
+}
+
+/* Wait for all submitted transfers, returns the first error one of them 
+	reported */
+static int relayboard_wait_urbs(struct usb_relayboard *dev) {
+	if (!wait_event_timeout(dev->urb_wait, !atomic_read(&dev->urbs_busy),
+			relayboard_xfer_timeout(dev))) {
+		/* Calls the completion handlers before returning */
+		usb_kill_anchored_urbs(&dev->submitted);
+		return -ETIMEDOUT;
+	}
+	return dev->urb_error;
+}
+
+/* Send count frames of the transfer buffer starting at frame first, chunk 
+	frames per bulk transfer. Up to urbs_in_flight transfers are queued at 
+	the endpoint at once, the bulk endpoint completes them in order, so the
+	urb used for a chunk is always done by the time we reuse it */
+static int send_relay_frames(struct usb_relayboard *dev, int first, int count,
+				 int chunk) {
+	int in_flight = clamp(urbs_in_flight, 1, RELAY_URB_COUNT);
+	int last = first + count;
+	int frames, offset;
+	int i = 0;
+	int result;
+	unsigned long timeout;
+	dev->urb_error = 0;
+	for (; first < last; first += frames) {
+		timeout = relayboard_xfer_timeout(dev);
+		if (!timeout || !wait_event_timeout(dev->urb_wait, 
+				atomic_read(&dev->urbs_busy) < in_flight || dev->urb_error,
+				timeout)) {
+			usb_kill_anchored_urbs(&dev->submitted);
+			return -ETIMEDOUT;
+		}
+		result = dev->urb_error;
+		if (result) {
+			goto error;
+		}
+		frames = min(chunk, last - first);
+		offset = first * RELAY_CMD_LENGTH;
+		result = relayboard_submit(dev, dev->urbs[i++ % in_flight],
+			dev->out_pipe, dev->frames + offset, dev->frames_dma + offset,
+			frames * RELAY_CMD_LENGTH);
+		if (result) {
+			goto error;
+		}
+	}
+	return relayboard_wait_urbs(dev);
+error:
+	/* Calls the completion handlers before returning */
+	usb_kill_anchored_urbs(&dev->submitted);
+	return result;
+}
+
+/* This actually doesn't read from the device but "from the driver" */
+static ssize_t relayboard_read(struct file *file, char *buffer, size_t count,
+			 loff_t *ppos)
+{
+	struct file_additions *infos;
+	struct usb_relayboard *dev;
+	struct relayboard_status status;
+	unsigned long gen;
+	char state_str[5];
+	size_t length;
+	infos = file->private_data;
+	dev = infos->device;
+	/* We won't read if count is too small, because reading one char at a
+		time doesn't make sense, the state could change till next call 
+		We need 3 chars (max. byte = "255") + newline */
+	if (!infos->binary && count < 4) {
+		return 0;
+	}
+	/* The state is the whole "file", so "cat" stops after it and programs
+		can read it again at offset 0 without re-opening the device */
+	relayboard_get_status(dev, &status, &gen);
+	if (infos->binary) {
+		state_str[0] = status.state;
+		length = 1;
+	} else {
+		length = scnprintf( state_str, sizeof(state_str), "%d\n", 
+			status.state );
+	}
+	/* Only a read from the start delivers this state */
+	if (*ppos == 0) {
+		infos->seen_gen = gen;
+	}
+	return simple_read_from_buffer(buffer, count, ppos, state_str, length);
 }
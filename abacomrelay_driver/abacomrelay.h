@@ -0,0 +1,215 @@
+/*
+ * ABACOM USB relayboard driver - userspace interface
+ *
+ * Shared by the driver and programs using /dev/usb/relayboard0,1,2..
+ *
+ * https://github.com/jonesman/ABACOM-Relayboard
+ */
+
+#ifndef _ABACOMRELAY_H
+#define _ABACOMRELAY_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * File modes
+ */
+
+/* Default, writes take the state as decimal text ("123\n"), reads return
+	it the same way */
+#define RELAYBOARD_MODE_TEXT		0
+/* Writes take 1 byte with the new state or 2 bytes with a mask and a value
+	for the relays in the mask, reads return 1 byte with the state at
+	offset 0 */
+#define RELAYBOARD_MODE_BINARY		1
+
+/*
+ * ioctl arguments
+ */
+
+/* Relays in mask get the state of the matching bit in value */
+struct relayboard_masked {
+	__u8 mask;
+	__u8 value;
+};
+
+/* Relays in mask switch on for width_us and off again afterwards */
+struct relayboard_pulse {
+	__u8 mask;
+	__u8 reserved[3];
+	__u32 width_us;
+};
+
+/* One step of a sequence, the relays get state delta_us after the step 
+	before (or the start, for the first step) */
+struct relayboard_step {
+	__u32 delta_us;
+	__u8 state;
+	__u8 reserved[3];
+};
+
+/* Sequence to load, steps points to count struct relayboard_step */
+struct relayboard_sequence {
+	__u64 steps;
+	__u32 count;
+	__u32 reserved;
+};
+
+/* Playback progress of the loaded sequence */
+struct relayboard_seq_status {
+	__u32 flags;	/* RELAYBOARD_SEQ_* */
+	__u32 count;	/* steps loaded */
+	__u32 step;		/* next step to play */
+	__u32 loops;	/* times the sequence started over */
+	__u32 reserved[4];
+};
+/* Start over after the last step, until stopped */
+#define RELAYBOARD_SEQ_LOOP			0x0001
+/* The sequence plays */
+#define RELAYBOARD_SEQ_RUNNING		0x0002
+
+/* One board of a group write, fd is an open file of it. The relays in mask
+	get the state of the matching bit in value, result is set to the error
+	of this board or 0 */
+struct relayboard_group_entry {
+	__s32 fd;
+	__u8 mask;
+	__u8 value;
+	__u8 reserved[2];
+	__s32 result;
+};
+
+/* Group write, entries points to count struct relayboard_group_entry */
+struct relayboard_group {
+	__u64 entries;
+	__u32 count;
+	__u32 reserved;
+};
+
+/* Result of reading the A6275 shift register back from the board */
+struct relayboard_hw_state {
+	__u8 state;		/* register contents, same bit order as the state */
+	__u8 flags;		/* RELAYBOARD_HW_* */
+};
+/* The relays have no supply, state is meaningless then */
+#define RELAYBOARD_HW_POWER_FAIL	0x01
+/* The register doesn't hold the state the driver remembers */
+#define RELAYBOARD_HW_MISMATCH		0x02
+
+/* What the driver knows about the board, read without waiting for writes */
+struct relayboard_status {
+	__u8 state;		/* state the board shows */
+	__u8 pending;	/* state it will show once writes are done */
+	__u16 flags;	/* RELAYBOARD_STATUS_* */
+	/* With RELAYBOARD_STATUS_FAILED, the frames of the failed state change
+		that reached the board. It only latches with the last one */
+	__u8 frames_done;
+	__u8 frames_total;
+	__u16 reserved0;
+	__u32 reserved[2];
+};
+/* A write is queued or being sent */
+#define RELAYBOARD_STATUS_BUSY		0x0001
+/* The last state change failed, the board still shows state */
+#define RELAYBOARD_STATUS_FAILED	0x0002
+/* A pulse is running */
+#define RELAYBOARD_STATUS_PULSE		0x0004
+/* A sequence plays */
+#define RELAYBOARD_STATUS_SEQUENCE	0x0008
+/* The relays have no supply, as the driver last saw it. poll() reports 
+	EPOLLPRI once this changed since the file got the status */
+#define RELAYBOARD_STATUS_POWER_FAIL	0x0010
+/* Only with the verify module parameter, the board didn't hold the state
+	before the last state change */
+#define RELAYBOARD_STATUS_MISMATCH	0x0020
+
+/* The page mmap() maps (read-only, length of one page at offset 0). The 
+	driver updates it whenever the state changes, seq is odd while it does.
+	Read seq, then the fields, then seq again, and start over if seq was odd
+	or has changed, relayboard_shared_read() below does that */
+struct relayboard_shared {
+	__u32 seq;
+	__u8 state;			/* state the board shows */
+	__u8 pending;		/* state it will show once writes are done */
+	__u16 flags;		/* RELAYBOARD_STATUS_BUSY, _FAILED, _POWER_FAIL, _MISMATCH */
+	__u64 gen;			/* counts changes of state */
+	__u64 update_ns;	/* CLOCK_MONOTONIC time of the last update */
+	/* With RELAYBOARD_STATUS_FAILED, the error and the frames of the failed
+		state change that reached the board */
+	__s32 error;
+	__u8 frames_done;
+	__u8 frames_total;
+	__u16 reserved0;
+	__u32 reserved[8];
+};
+
+#ifndef __KERNEL__
+/* Get a consistent copy of the mapped page */
+static inline void relayboard_shared_read(const struct relayboard_shared *page,
+			  struct relayboard_shared *copy)
+{
+	__u32 seq;
+	do {
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		__builtin_memcpy(copy, (const void *)page, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&page->seq, __ATOMIC_RELAXED));
+	copy->seq = seq;
+}
+#endif
+
+/*
+ * ioctl commands
+ */
+
+#define RELAYBOARD_IOC_MAGIC		'R'
+
+/* The commands that switch relays (SET/CLEAR/TOGGLE_BITS, SET_MASKED, PULSE
+	and SEQ_LOAD/START/STOP) fail with EBADF unless the file is open for 
+	writing */
+
+/* Select the mode of this open file (__u32, one of RELAYBOARD_MODE_*) */
+#define RELAYBOARD_IOC_SET_MODE		_IOW(RELAYBOARD_IOC_MAGIC, 0x80, __u32)
+#define RELAYBOARD_IOC_GET_MODE		_IOR(RELAYBOARD_IOC_MAGIC, 0x81, __u32)
+
+/* State of the relays (__u8), as the driver remembers it */
+#define RELAYBOARD_IOC_GET			_IOR(RELAYBOARD_IOC_MAGIC, 0x82, __u8)
+/* Switch on, switch off or toggle the relays set in the __u8 argument,
+	the others stay as they are. Like writes, these wait for the board
+	unless the file is non-blocking */
+#define RELAYBOARD_IOC_SET_BITS		_IOW(RELAYBOARD_IOC_MAGIC, 0x83, __u8)
+#define RELAYBOARD_IOC_CLEAR_BITS	_IOW(RELAYBOARD_IOC_MAGIC, 0x84, __u8)
+#define RELAYBOARD_IOC_TOGGLE_BITS	_IOW(RELAYBOARD_IOC_MAGIC, 0x85, __u8)
+#define RELAYBOARD_IOC_SET_MASKED	_IOW(RELAYBOARD_IOC_MAGIC, 0x86, struct relayboard_masked)
+/* Read the state back from the board itself, this takes about 40 USB
+	transfers, RELAYBOARD_IOC_GET is the cheap way */
+#define RELAYBOARD_IOC_READ_HW		_IOR(RELAYBOARD_IOC_MAGIC, 0x87, struct relayboard_hw_state)
+#define RELAYBOARD_IOC_GET_STATUS	_IOR(RELAYBOARD_IOC_MAGIC, 0x88, struct relayboard_status)
+/* Longest time (__u32, ms) writes, ioctls and fsync on this open file wait 
+	for the board, 0 (default) for no limit. When it runs out they fail with
+	ETIMEDOUT, the state change itself stays queued */
+#define RELAYBOARD_IOC_SET_TIMEOUT	_IOW(RELAYBOARD_IOC_MAGIC, 0x89, __u32)
+#define RELAYBOARD_IOC_GET_TIMEOUT	_IOR(RELAYBOARD_IOC_MAGIC, 0x8a, __u32)
+/* Start a pulse, timed by the driver. Fails with EBUSY while another one 
+	runs on the board. Waits until the relays switched on unless the file is
+	non-blocking, the pulse itself runs in the background */
+#define RELAYBOARD_IOC_PULSE		_IOW(RELAYBOARD_IOC_MAGIC, 0x8b, struct relayboard_pulse)
+/* Load a sequence of timed states (at most 65536 steps) to play in the 
+	background. Fails with EBUSY while one plays. The driver queues each 
+	state like a non-blocking write, steps that come too late are skipped */
+#define RELAYBOARD_IOC_SEQ_LOAD		_IOW(RELAYBOARD_IOC_MAGIC, 0x8c, struct relayboard_sequence)
+/* Play the loaded sequence from the start (__u32, 0 or RELAYBOARD_SEQ_LOOP).
+	A loop fails with EINVAL if one pass takes less than 1ms or less than a
+	state change */
+#define RELAYBOARD_IOC_SEQ_START	_IOW(RELAYBOARD_IOC_MAGIC, 0x8d, __u32)
+/* Stop playing, the relays keep the state of the last step */
+#define RELAYBOARD_IOC_SEQ_STOP		_IO(RELAYBOARD_IOC_MAGIC, 0x8e)
+#define RELAYBOARD_IOC_SEQ_STATUS	_IOR(RELAYBOARD_IOC_MAGIC, 0x8f, struct relayboard_seq_status)
+/* Switch up to 16 boards together, on any open board file. All boards are
+	shifted at the same time and latched right after each other, none of 
+	them if shifting failed on one (the others report ECANCELED). Waits for
+	the boards and returns the first error */
+#define RELAYBOARD_IOC_GROUP_SET	_IOW(RELAYBOARD_IOC_MAGIC, 0x90, struct relayboard_group)
+
+#endif /* _ABACOMRELAY_H */
@@ -0,0 +1,160 @@
+/*
+ * ABACOM USB relayboard driver - tracepoints
+ *
+ * Events under tracing/events/abacomrelay, every one of them carries the
+ * minor of the board, so they can be told apart with several boards
+ *
+ * https://github.com/jonesman/ABACOM-Relayboard
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM abacomrelay
+
+#if !defined(_ABACOMRELAY_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ABACOMRELAY_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Transfers
+ */
+
+/* A transfer of frames frames starting at frame frame was submitted, frame
+	is -1 for transfers outside the frame buffer (input reads) */
+TRACE_EVENT(abacomrelay_frame_submit,
+	TP_PROTO(int minor, __u8 state, int frame, int frames),
+	TP_ARGS(minor, state, frame, frames),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(__u8, state)
+		__field(int, frame)
+		__field(int, frames)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->state = state;
+		__entry->frame = frame;
+		__entry->frames = frames;
+	),
+	TP_printk("minor=%d state=0x%02x frame=%d frames=%d", __entry->minor,
+		__entry->state, __entry->frame, __entry->frames)
+);
+
+/* The transfer completed, status and actual_length as the urb reports them */
+TRACE_EVENT(abacomrelay_frame_complete,
+	TP_PROTO(int minor, __u8 state, int frame, int status, int actual_length),
+	TP_ARGS(minor, state, frame, status, actual_length),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(__u8, state)
+		__field(int, frame)
+		__field(int, status)
+		__field(int, actual_length)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->state = state;
+		__entry->frame = frame;
+		__entry->status = status;
+		__entry->actual_length = actual_length;
+	),
+	TP_printk("minor=%d state=0x%02x frame=%d status=%d actual_length=%d",
+		__entry->minor, __entry->state, __entry->frame, __entry->status,
+		__entry->actual_length)
+);
+
+/*
+ * State changes
+ */
+
+/* relayboard_send_status() starts sending state in frames frames */
+TRACE_EVENT(abacomrelay_write_start,
+	TP_PROTO(int minor, __u8 state, int frames),
+	TP_ARGS(minor, state, frames),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(__u8, state)
+		__field(int, frames)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->state = state;
+		__entry->frames = frames;
+	),
+	TP_printk("minor=%d state=0x%02x frames=%d", __entry->minor,
+		__entry->state, __entry->frames)
+);
+
+/* The board latched state, shift_ns after sending it started */
+TRACE_EVENT(abacomrelay_write_latch,
+	TP_PROTO(int minor, __u8 state, s64 shift_ns),
+	TP_ARGS(minor, state, shift_ns),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(__u8, state)
+		__field(s64, shift_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->state = state;
+		__entry->shift_ns = shift_ns;
+	),
+	TP_printk("minor=%d state=0x%02x shift_ns=%lld", __entry->minor,
+		__entry->state, __entry->shift_ns)
+);
+
+/* relayboard_send_status() is done, frames of the state reached the board */
+TRACE_EVENT(abacomrelay_write_end,
+	TP_PROTO(int minor, __u8 state, int frames, int result),
+	TP_ARGS(minor, state, frames, result),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(__u8, state)
+		__field(int, frames)
+		__field(int, result)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->state = state;
+		__entry->frames = frames;
+		__entry->result = result;
+	),
+	TP_printk("minor=%d state=0x%02x frames=%d result=%d", __entry->minor,
+		__entry->state, __entry->frames, __entry->result)
+);
+
+/*
+ * Locking
+ */
+
+DECLARE_EVENT_CLASS(abacomrelay_lock,
+	TP_PROTO(int minor),
+	TP_ARGS(minor),
+	TP_STRUCT__entry(
+		__field(int, minor)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+	),
+	TP_printk("minor=%d", __entry->minor)
+);
+
+/* dev->mutex was taken and is given back */
+DEFINE_EVENT(abacomrelay_lock, abacomrelay_lock_acquire,
+	TP_PROTO(int minor),
+	TP_ARGS(minor)
+);
+
+DEFINE_EVENT(abacomrelay_lock, abacomrelay_lock_release,
+	TP_PROTO(int minor),
+	TP_ARGS(minor)
+);
+
+#endif /* _ABACOMRELAY_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE abacomrelay_trace
+#include <trace/define_trace.h>
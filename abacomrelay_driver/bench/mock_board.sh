@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# ABACOM USB relayboard driver - mock board setup
+#
+# Creates a USB gadget on dummy_hcd that looks like the board (1a86:5512,
+# 96mA, one interface with 3 endpoints) and runs mock_ch341 behind it. The
+# driver binds to it and creates /dev/usb/relayboardN as for a real board
+#
+# Usage (as root): mock_board.sh start [mock_ch341 options] | stop
+#
+# https://github.com/jonesman/ABACOM-Relayboard
+
+set -e
+
+GADGET=/sys/kernel/config/usb_gadget/relayboard
+FFS=/run/relayboard-mock
+DIR=$(dirname "$0")
+
+start() {
+	modprobe libcomposite
+	modprobe dummy_hcd
+	mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+	mkdir -p "$GADGET"
+	echo 0x1a86 > "$GADGET/idVendor"
+	echo 0x5512 > "$GADGET/idProduct"
+	mkdir -p "$GADGET/configs/c.1"
+	# The driver matches on this unusual value
+	echo 96 > "$GADGET/configs/c.1/MaxPower"
+	mkdir -p "$GADGET/functions/ffs.ch341"
+	ln -sf "$GADGET/functions/ffs.ch341" "$GADGET/configs/c.1/"
+	mkdir -p "$FFS"
+	mountpoint -q "$FFS" || mount -t functionfs ch341 "$FFS"
+	# The function needs its descriptors before the gadget can be bound
+	"$DIR/mock_ch341" "$@" "$FFS" &
+	echo $! > "$FFS.pid"
+	sleep 1
+	ls /sys/class/udc | grep dummy_udc | head -n 1 > "$GADGET/UDC"
+}
+
+stop() {
+	[ -f "$FFS.pid" ] && kill "$(cat "$FFS.pid")" 2>/dev/null || true
+	rm -f "$FFS.pid"
+	[ -d "$GADGET" ] || return 0
+	echo "" > "$GADGET/UDC" 2>/dev/null || true
+	rm -f "$GADGET/configs/c.1/ffs.ch341"
+	sleep 1
+	mountpoint -q "$FFS" && umount "$FFS"
+	rmdir "$GADGET/functions/ffs.ch341" "$GADGET/configs/c.1" "$GADGET"
+}
+
+case "$1" in
+start)
+	shift
+	start "$@"
+	;;
+stop)
+	stop
+	;;
+*)
+	echo "Usage: $0 start [mock_ch341 options] | stop"
+	exit 2
+	;;
+esac
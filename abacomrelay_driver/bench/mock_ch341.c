@@ -0,0 +1,366 @@
+/*
+ * ABACOM USB relayboard driver - mock board
+ *
+ * FunctionFS function that looks like the CH341 of the board to the driver
+ * and decodes the A6275 shift protocol from the frames it gets:
+ *	- a rising CLK shifts DATA into the 8 bit register
+ *	- a rising LATCH copies the register to the relays
+ *	- the 0xa0 command, alone or after frames, answers with the data
+ *	  lines, D7 is the serial out of the register and PFT the output of
+ *	  relay 1, high while that relay is off. Without relay supply, from -p
+ *	  on or toggled with SIGUSR1, both read high
+ * Every latched state is printed, the counters on SIGINT/SIGTERM
+ *
+ * mock_board.sh sets up a gadget on dummy_hcd around it, so the driver
+ * binds to it like to a real board
+ *
+ * https://github.com/jonesman/ABACOM-Relayboard
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <endian.h>
+#include <byteswap.h>
+#include <linux/usb/functionfs.h>
+
+/* The descriptors are static initializers, htole32() isn't constant */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define cpu_to_le16(x)	(x)
+#define cpu_to_le32(x)	(x)
+#else
+#define cpu_to_le16(x)	__bswap_constant_16(x)
+#define cpu_to_le32(x)	__bswap_constant_32(x)
+#endif
+
+/*
+ * Constants
+ */
+
+/* Same as in abacomrelay.c */
+#define RELAY_CMD_LENGTH		11
+#define RELAY_CMD_DATA_OFFSET	5
+#define RELAY_INPUT_CMD			0xa0
+#define RELAY_INPUT_LENGTH		6
+#define RELAY_PIN_LATCH			0x01
+#define RELAY_PIN_CLK			0x08
+#define RELAY_PIN_DATA			0x20
+#define RELAY_PIN_PFT			0x40
+#define RELAY_PIN_READ			0x80
+/* Largest transfer the driver sends, a whole frame sequence */
+#define MOCK_BUFFER_LENGTH		4096
+
+static const unsigned char frame_header[RELAY_CMD_DATA_OFFSET] = {
+	0xa1, 0x6a, 0x1f, 0x00, 0x10
+};
+
+/*
+ * Descriptors
+ */
+
+/* Endpoints like on the board, ep1 of FunctionFS is the bulk in, ep2 the
+	bulk out and ep3 the interrupt endpoint the driver doesn't use */
+struct mock_descs {
+	struct usb_interface_descriptor intf;
+	struct usb_endpoint_descriptor_no_audio bulk_in;
+	struct usb_endpoint_descriptor_no_audio bulk_out;
+	struct usb_endpoint_descriptor_no_audio irq_in;
+} __attribute__((packed));
+
+#define MOCK_DESCS(packet) { \
+	.intf = { \
+		.bLength = sizeof(struct usb_interface_descriptor), \
+		.bDescriptorType = USB_DT_INTERFACE, \
+		.bNumEndpoints = 3, \
+		.bInterfaceClass = USB_CLASS_VENDOR_SPEC, \
+		.iInterface = 1, \
+	}, \
+	.bulk_in = { \
+		.bLength = USB_DT_ENDPOINT_SIZE, \
+		.bDescriptorType = USB_DT_ENDPOINT, \
+		.bEndpointAddress = 2 | USB_DIR_IN, \
+		.bmAttributes = USB_ENDPOINT_XFER_BULK, \
+		.wMaxPacketSize = cpu_to_le16(packet), \
+	}, \
+	.bulk_out = { \
+		.bLength = USB_DT_ENDPOINT_SIZE, \
+		.bDescriptorType = USB_DT_ENDPOINT, \
+		.bEndpointAddress = 2 | USB_DIR_OUT, \
+		.bmAttributes = USB_ENDPOINT_XFER_BULK, \
+		.wMaxPacketSize = cpu_to_le16(packet), \
+	}, \
+	.irq_in = { \
+		.bLength = USB_DT_ENDPOINT_SIZE, \
+		.bDescriptorType = USB_DT_ENDPOINT, \
+		.bEndpointAddress = 1 | USB_DIR_IN, \
+		.bmAttributes = USB_ENDPOINT_XFER_INT, \
+		.wMaxPacketSize = cpu_to_le16(8), \
+		.bInterval = 1, \
+	}, \
+}
+
+static const struct {
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 fs_count;
+	__le32 hs_count;
+	struct mock_descs fs;
+	struct mock_descs hs;
+} __attribute__((packed)) descriptors = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC),
+		.length = cpu_to_le32(sizeof(descriptors)),
+	},
+	.fs_count = cpu_to_le32(4),
+	.hs_count = cpu_to_le32(4),
+	.fs = MOCK_DESCS(64),
+	.hs = MOCK_DESCS(512),
+};
+
+#define MOCK_INTERFACE_NAME	"CH341 relayboard mock"
+
+static const struct {
+	struct usb_functionfs_strings_head header;
+	struct {
+		__le16 code;
+		const char name[sizeof(MOCK_INTERFACE_NAME)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+		.length = cpu_to_le32(sizeof(strings)),
+		.str_count = cpu_to_le32(1),
+		.lang_count = cpu_to_le32(1),
+	},
+	.lang0 = {
+		cpu_to_le16(0x0409),
+		MOCK_INTERFACE_NAME,
+	},
+};
+
+/*
+ * Board model
+ */
+
+static unsigned char pins;		/* data lines of the last frame */
+static unsigned char shift;		/* A6275 shift register */
+static unsigned char relays;	/* latched state */
+static volatile sig_atomic_t power_fail;
+static int quiet;
+static useconds_t delay_us;
+static volatile sig_atomic_t stop;
+static unsigned long frames, states, bad_frames, input_reads;
+
+/* Apply one frame to the lines of the A6275 */
+static void mock_frame(const unsigned char *frame)
+{
+	unsigned char next;
+	if (memcmp(frame, frame_header, sizeof(frame_header))) {
+		bad_frames++;
+		return;
+	}
+	frames++;
+	next = frame[RELAY_CMD_DATA_OFFSET];
+	if ((next & RELAY_PIN_CLK) && !(pins & RELAY_PIN_CLK)) {
+		shift = (shift << 1) | !!(next & RELAY_PIN_DATA);
+	}
+	if ((next & RELAY_PIN_LATCH) && !(pins & RELAY_PIN_LATCH)) {
+		relays = shift;
+		states++;
+		if (!quiet) {
+			printf("state %3d\n", relays);
+			fflush(stdout);
+		}
+	}
+	pins = next;
+}
+
+/* Answer of the 0xa0 command, the lines as the CH341 sees them */
+static void mock_input(unsigned char *answer)
+{
+	memset(answer, 0, RELAY_INPUT_LENGTH);
+	answer[0] = pins & ~(RELAY_PIN_READ | RELAY_PIN_PFT);
+	if (power_fail) {
+		/* Without supply the register reads all ones */
+		answer[0] |= RELAY_PIN_READ | RELAY_PIN_PFT;
+		input_reads++;
+		return;
+	}
+	if (shift & 0x80) {
+		answer[0] |= RELAY_PIN_READ;
+	}
+	/* The output of relay 1 sinks its coil while the relay is on */
+	if (!(relays & 0x01)) {
+		answer[0] |= RELAY_PIN_PFT;
+	}
+	input_reads++;
+}
+
+/*
+ * FunctionFS
+ */
+
+/* ep0 has to be read for the function to work, the events are only shown */
+static void *mock_ep0(void *arg)
+{
+	static const char *names[] = {
+		"bind", "unbind", "enable", "disable", "setup", "suspend", "resume"
+	};
+	struct usb_functionfs_event event;
+	int ep0 = *(int *)arg;
+	while (read(ep0, &event, sizeof(event)) == sizeof(event)) {
+		if (!quiet && event.type < sizeof(names) / sizeof(names[0])) {
+			printf("event %s\n", names[event.type]);
+			fflush(stdout);
+		}
+	}
+	return NULL;
+}
+
+static int mock_open(const char *dir, const char *name, int flags)
+{
+	char path[256];
+	int fd;
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, flags);
+	if (fd < 0) {
+		fprintf(stderr, "mock_ch341: Can't open %s: %s\n", path,
+			strerror(errno));
+	}
+	return fd;
+}
+
+static void mock_stop(int sig)
+{
+	stop = 1;
+}
+
+/* The relay supply fails or comes back, printf() isn't safe in here */
+static void mock_power(int sig)
+{
+	static const char *const messages[] = {
+		"supply restored\n", "supply lost\n"
+	};
+	const char *message;
+	power_fail = !power_fail;
+	message = messages[power_fail];
+	if (!quiet && write(STDOUT_FILENO, message, strlen(message)) < 0) {
+		/* Nothing to be done about it */
+	}
+}
+
+static void usage(void)
+{
+	printf("Usage: mock_ch341 [-p] [-q] [-t us] functionfs-dir\n");
+	printf("  -p     simulate a missing relay supply, SIGUSR1 toggles it\n");
+	printf("  -q     don't print every state\n");
+	printf("  -t us  time each transfer takes (a real board needs about 1000)\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char buffer[MOCK_BUFFER_LENGTH];
+	unsigned char answer[RELAY_INPUT_LENGTH];
+	struct sigaction action;
+	pthread_t thread;
+	const char *dir;
+	int ep0, ep_in, ep_out;
+	ssize_t length, i;
+	int opt;
+	while ((opt = getopt(argc, argv, "hpqt:")) != -1) {
+		switch (opt) {
+		case 'p':
+			power_fail = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 't':
+			delay_us = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 2;
+	}
+	dir = argv[optind];
+	ep0 = mock_open(dir, "ep0", O_RDWR);
+	if (ep0 < 0) {
+		return 1;
+	}
+	if (write(ep0, &descriptors, sizeof(descriptors)) < 0
+		|| write(ep0, &strings, sizeof(strings)) < 0) {
+		fprintf(stderr, "mock_ch341: Can't write descriptors: %s\n",
+			strerror(errno));
+		return 1;
+	}
+	ep_in = mock_open(dir, "ep1", O_RDWR);
+	ep_out = mock_open(dir, "ep2", O_RDWR);
+	if (ep_in < 0 || ep_out < 0) {
+		return 1;
+	}
+	if (pthread_create(&thread, NULL, mock_ep0, &ep0)) {
+		fprintf(stderr, "mock_ch341: Can't start the ep0 thread\n");
+		return 1;
+	}
+	/* Without SA_RESTART, so the blocking read ends on the signal */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = mock_stop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	/* Transfers in progress just carry on */
+	action.sa_handler = mock_power;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, NULL);
+	if (!quiet) {
+		printf("ready\n");
+		fflush(stdout);
+	}
+	/* Every read is one transfer, frames and input commands in any order,
+		worked through one after the other like the CH341 does */
+	while (!stop) {
+		length = read(ep_out, buffer, sizeof(buffer));
+		if (length < 0) {
+			/* Not enabled yet or reset by the host */
+			if (errno == EINTR || errno == ESHUTDOWN || errno == EAGAIN) {
+				continue;
+			}
+			fprintf(stderr, "mock_ch341: Read failed: %s\n", strerror(errno));
+			break;
+		}
+		if (delay_us) {
+			usleep(delay_us);
+		}
+		for (i = 0; i < length; ) {
+			if (buffer[i] == RELAY_INPUT_CMD) {
+				mock_input(answer);
+				if (write(ep_in, answer, sizeof(answer)) < 0) {
+					fprintf(stderr, "mock_ch341: Answer failed: %s\n",
+						strerror(errno));
+				}
+				i++;
+			} else if (i + RELAY_CMD_LENGTH <= length) {
+				mock_frame(buffer + i);
+				i += RELAY_CMD_LENGTH;
+			} else {
+				bad_frames++;
+				break;
+			}
+		}
+	}
+	printf("frames %lu states %lu bad_frames %lu input_reads %lu relays %d\n",
+		frames, states, bad_frames, input_reads, relays);
+	return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * ABACOM USB relayboard driver - benchmark
+ *
+ * Switches a board through every write path of the driver and reports the
+ * latency of each state change and the states per second:
+ *	text	decimal text writes
+ *	binary	1 byte writes in binary mode
+ *	ioctl	RELAYBOARD_IOC_SET_MASKED
+ *	async	non-blocking binary writes, fsync at the end
+ * Every state differs from the one before, so no write is a no-op. Only
+ * states that reached the board count for the states per second, as the
+ * generation counter of the mapped status page tells: non-blocking writes
+ * coalesce, most of them never latch. The board gets its old state back
+ * afterwards
+ *
+ * Build with "make bench", works on a real board or on mock_ch341
+ *
+ * https://github.com/jonesman/ABACOM-Relayboard
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../abacomrelay.h"
+
+/*
+ * Constants
+ */
+
+#define DEFAULT_DEVICE		"/dev/usb/relayboard0"
+#define DEFAULT_COUNT		200
+
+/* Write paths, in the order "all" runs them */
+enum bench_mode {
+	MODE_TEXT,
+	MODE_BINARY,
+	MODE_IOCTL,
+	MODE_ASYNC,
+	MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = {
+	"text", "binary", "ioctl", "async"
+};
+
+/*
+ * Helpers
+ */
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Value at fraction p of the sorted latencies */
+static double percentile(const double *sorted, int count, double p)
+{
+	int i = (int)(p * (count - 1) + 0.5);
+	return sorted[i];
+}
+
+/* Alternating patterns, so every state changes all relays */
+static unsigned char bench_state(int i)
+{
+	return (i & 1) ? 0x55 : 0xaa;
+}
+
+/* Set one state through the given path */
+static int bench_write(int fd, enum bench_mode mode, unsigned char state)
+{
+	struct relayboard_masked masked;
+	char text[8];
+	int length;
+	switch (mode) {
+	case MODE_TEXT:
+		length = snprintf(text, sizeof(text), "%d\n", state);
+		return write(fd, text, length) == length ? 0 : -1;
+	case MODE_BINARY:
+	case MODE_ASYNC:
+		return write(fd, &state, 1) == 1 ? 0 : -1;
+	case MODE_IOCTL:
+		masked.mask = 0xff;
+		masked.value = state;
+		return ioctl(fd, RELAYBOARD_IOC_SET_MASKED, &masked);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/*
+ * Benchmark
+ */
+
+static int bench_run(const char *device, enum bench_mode mode, int count)
+{
+	const struct relayboard_shared *page = MAP_FAILED;
+	struct relayboard_shared shared;
+	double *latency;
+	double start, end, total;
+	__u64 first_gen;
+	long latched;
+	__u32 file_mode = RELAYBOARD_MODE_BINARY;
+	int flags = O_RDWR;
+	int fd, i;
+	int result = -1;
+	if (mode == MODE_ASYNC) {
+		flags |= O_NONBLOCK;
+	}
+	fd = open(device, flags);
+	if (fd < 0) {
+		fprintf(stderr, "relaybench: Can't open %s: %s\n", device,
+			strerror(errno));
+		return -1;
+	}
+	page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		fprintf(stderr, "relaybench: Can't map the status page: %s\n",
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+	latency = calloc(count, sizeof(*latency));
+	if (!latency) {
+		fprintf(stderr, "relaybench: Out of memory\n");
+		goto out;
+	}
+	if (mode != MODE_TEXT && ioctl(fd, RELAYBOARD_IOC_SET_MODE, &file_mode)) {
+		fprintf(stderr, "relaybench: Can't switch to binary mode: %s\n",
+			strerror(errno));
+		goto out;
+	}
+	relayboard_shared_read(page, &shared);
+	first_gen = shared.gen;
+	start = now_us();
+	for (i = 0; i < count; i++) {
+		latency[i] = now_us();
+		if (bench_write(fd, mode, bench_state(i))) {
+			fprintf(stderr, "relaybench: %s write %d failed: %s\n",
+				mode_names[mode], i, strerror(errno));
+			goto out;
+		}
+		latency[i] = now_us() - latency[i];
+	}
+	/* Non-blocking writes only queued the states, wait for the last one */
+	if (fsync(fd)) {
+		fprintf(stderr, "relaybench: %s fsync failed: %s\n", mode_names[mode],
+			strerror(errno));
+		goto out;
+	}
+	end = now_us();
+	total = end - start;
+	relayboard_shared_read(page, &shared);
+	latched = (long)(shared.gen - first_gen);
+	qsort(latency, count, sizeof(*latency), compare_double);
+	printf("%-7s %6d writes %6ld latched %9.1f states/s  p50 %9.1f us"
+		"  p99 %9.1f us  max %9.1f us\n", mode_names[mode], count, latched,
+		latched * 1e6 / total, percentile(latency, count, 0.5),
+		percentile(latency, count, 0.99), latency[count - 1]);
+	result = 0;
+out:
+	free(latency);
+	munmap((void *)page, sizeof(*page));
+	close(fd);
+	return result;
+}
+
+static void usage(void)
+{
+	printf("Usage: relaybench [-d device] [-n count] [-m mode]\n");
+	printf("  -d device  board to switch (default: %s)\n", DEFAULT_DEVICE);
+	printf("  -n count   states per write path (default: %d)\n", DEFAULT_COUNT);
+	printf("  -m mode    text, binary, ioctl, async or all (default: all)\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = DEFAULT_DEVICE;
+	int count = DEFAULT_COUNT;
+	int first = 0, last = MODE_COUNT - 1;
+	__u8 saved;
+	int fd, opt, mode;
+	int result = 0;
+	while ((opt = getopt(argc, argv, "hd:n:m:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			if (count < 1) {
+				usage();
+				return 2;
+			}
+			break;
+		case 'm':
+			if (strcmp(optarg, "all")) {
+				for (mode = 0; mode < MODE_COUNT; mode++) {
+					if (!strcmp(optarg, mode_names[mode])) {
+						break;
+					}
+				}
+				if (mode == MODE_COUNT) {
+					usage();
+					return 2;
+				}
+				first = last = mode;
+			}
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	/* Remember the state to restore it afterwards */
+	fd = open(device, O_RDWR);
+	if (fd < 0 || ioctl(fd, RELAYBOARD_IOC_GET, &saved)) {
+		fprintf(stderr, "relaybench: Can't get the state of %s: %s\n", device,
+			strerror(errno));
+		return 1;
+	}
+	for (mode = first; mode <= last; mode++) {
+		if (bench_run(device, mode, count)) {
+			result = 1;
+		}
+	}
+	if (bench_write(fd, MODE_IOCTL, saved)) {
+		fprintf(stderr, "relaybench: Can't restore the state: %s\n",
+			strerror(errno));
+		result = 1;
+	}
+	close(fd);
+	return result;
+}
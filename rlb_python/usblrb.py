@@ -40,6 +40,27 @@
 ### to read relays status from a devices ...
 ###     sudo python ./usblrb.py -d 0
 
+### to set several boards at once (they switch at nearly the same time) ...
+###     sudo python ./usblrb.py -d 0 -s 123 -d 1 -s 7
+### or all of them from one 32 bit value, byte 0 for DEVICE 0 ...
+###     sudo python ./usblrb.py --bank 0x0700007b
+
+### If the abacomrelay kernel driver is loaded, the boards are used through
+### /dev/usb/relayboardN (DEVICE N), which is much faster. To use pyUSB
+### anyway (e.g. to compare)...
+###     sudo python ./usblrb.py -d 0 -s 123 --usb
+
+### to compare the backends (100 state changes each, read back every one) ...
+###     sudo python ./usblrb.py -d 0 --bench 100 --verify [--json]
+
+### to keep running and serve all boards on a Unix socket ...
+###     sudo python ./usblrb.py --daemon
+### and then (much faster than starting usblrb.py every time)...
+###     python ./usblrbc.py set 0 123
+
+### to send every frame in its own USB write (as older versions did) ...
+###     sudo python ./usblrb.py -d 0 -s 123 --no-batch
+
 ### DEVICE: zero-based CH341A device list index 
 ### STATUS: Bit 0..7 represent REL1..REL8 status:
 ### bit0..7 set = relay1..8 on
@@ -54,14 +75,26 @@
 ### Do NOT ask me how to install these libs.
 ### It may be tricky, but somehow you will succeed!
 ### Google for it!
+### (Not needed if the abacomrelay kernel driver is loaded, see below.)
 
-import usb.core
-import usb.util
+try:
+    import usb.core
+    import usb.util
+except ImportError:
+    usb = None # only boards of the kernel driver can be used then
 
 ### These libs likely are already pre-installed on RaspPi...
 import sys
 import time
 import getopt
+import os
+import socket
+import select
+import threading
+import glob
+import fcntl
+import ctypes
+import json
 
 ############# (Some of) the CH341A API ####################
 
@@ -80,31 +113,58 @@ ep2in  = 0x82 # CH341A Endpoint for incoming data (CH341A->PC)
 ch341a_set_output = 0xA1
 ch341a_get_input = 0xA0
 
+### Message bytes were captured from WIN driver DLL.
+### NOT ask me what these bytes mean in detail!
+### The data byte goes between header and trailer, so the frames for all
+### 256 data bytes are built once here.
+setOutputHeader = bytes([ch341a_set_output, 0x6a, 0x1f, 0x00, 0x10])
+setOutputTrailer = bytes([0x3f, 0x00, 0x00, 0x00, 0x00])
+setOutputFrames = [setOutputHeader + bytes([b]) + setOutputTrailer
+                   for b in range(0, 256)]
+
+### Batched mode: setOutput() only collects the frames, flushOutput()
+### sends them in one USB write. If the board refuses that write,
+### the frames go out one by one as before (and from then on).
+batchOutput = True
+outputFrames = []
+
 ### CH341A API function
 def setOutput(DataByte): 
-    ### Message bytes were captured from WIN driver DLL.
-    ### NOT ask me what these bytes mean in detail!
     global dev
-    msg = bytearray()
-    msg.append(ch341a_set_output)
-    msg.append(0x6a)
-    msg.append(0x1f)
-    msg.append(0x00)
-    msg.append(0x10)
-    msg.append(DataByte)
-    msg.append(0x3f)
-    msg.append(0x00)
-    msg.append(0x00)
-    msg.append(0x00)
-    msg.append(0x00)
-    dev.write(ep2out,msg,0)
+    if batchOutput:
+        outputFrames.append(setOutputFrames[DataByte])
+    else:
+        dev.write(ep2out,setOutputFrames[DataByte],0)
+
+### Send the frames setOutput() collected, followed by command (if any)
+### in the same USB write. The CH341A works through a write command by
+### command, so that is the same as writing them one after the other.
+def flushOutput(command=b''):
+    global dev, batchOutput
+    if len(outputFrames) == 0:
+        if len(command) > 0:
+            dev.write(ep2out,command,0)
+        return
+    frames = outputFrames[:]
+    del outputFrames[:]
+    try:
+        dev.write(ep2out,b''.join(frames) + command,0)
+        return
+    except usb.core.USBError:
+        batchOutput = False
+    ### Every frame sequence shifts all 8 bits before it latches,
+    ### so sending it again from the start is safe.
+    for frame in frames:
+        dev.write(ep2out,frame,0)
+    if len(command) > 0:
+        dev.write(ep2out,command,0)
 
 ### CH341A API function
+### The lines must be set before they are read, so frames still
+### collected go out first, in the same write as the command.
 def getInput():
     global dev
-    msg = bytearray()
-    msg.append(ch341a_get_input)
-    dev.write(ep2out,msg,0)
+    flushOutput(bytes([ch341a_get_input]))
     response=dev.read(ep2in,6)
     return response 
 
@@ -118,28 +178,113 @@ PFT  =   0x40 # port function test from A6275 PIN5 (REL1)
 READ =   0x80 # from A6275 Serial out
 
 ### Shift bits from CH341A to Allegro A6275 driver chip...
-def shiftOutBits(aStatus):
-    setOutput(0) #All lines low
+### The A6275 takes DATA on the rising CLK edge, so CLK may go low together
+### with the DATA change of the next bit, 2 frames per bit are enough.
+### The first frame also takes Latch low before anything is clocked.
+def shiftOutData(aStatus):
+    lines = []
     for i in range(0,8): # Bit 0..7 testen...
         if (aStatus & (1 << (7-i)))!=0 :
-            setOutput(DATA) #DATA high "1"
-	    # and generate CLK pulse...
-            setOutput(CLK or DATA) #CLK high
-            setOutput(DATA) #CLK low
+            lines.append(DATA) #DATA high "1", CLK low
+            lines.append(CLK | DATA) #CLK high
         else:
-            setOutput(0) #DATA low "0"
-	    # and generate CLK pulse...
-            setOutput(CLK) #CLK high
-            setOutput(0) #CLK low
-    setOutput(0) #All lines 0
+            lines.append(0) #DATA low "0", CLK low
+            lines.append(CLK) #CLK high
+    lines.append(0) #All lines 0
+    return lines
+
+def shiftOutBits(aStatus):
+    for DataByte in shiftOutData(aStatus):
+        setOutput(DataByte)
+
+### Shift bits without latching them, e.g. to restore the data register
+def writeBits(aStatus):
+    shiftOutBits(aStatus)
+    flushOutput()
+
+### Latch pulse that outputs the data register to the relays
+latchData = [LATCH, 0] # Latch high, then Latch, CLK, OE low
 
 ### Shift out (write / set) the relays status to Allegro A6275
 def setRelays(aStatus):
-    setOutput(0) # Latch low
     shiftOutBits(aStatus) # this is silent so far (without latch)
     # now generate a latch clock to output data to relays...
-    setOutput(LATCH) #Latch high
-    setOutput(0) # Latch, CLK, OE low
+    for DataByte in latchData:
+        setOutput(DataByte)
+    flushOutput()
+
+### Set several boards at once, one worker thread per board.
+### All workers shift out their status, wait for each other and then
+### latch, so the relays of all boards switch at nearly the same time.
+### Returns one [error, shift time, latch time] per board (times from
+### time.monotonic(), error None or the exception).
+def setRelaysConcurrent(boards, statuses):
+    results = [[None, 0, 0] for board in boards]
+    barrier = threading.Barrier(len(boards))
+
+    def send(board, data):
+        global batchOutput
+        if batchOutput:
+            try:
+                board.write(ep2out,b''.join(setOutputFrames[b] for b in data),0)
+                return
+            except usb.core.USBError:
+                batchOutput = False
+        ### Like in flushOutput(), nothing latches before the last frame,
+        ### so the frames can go again one by one
+        for b in data:
+            board.write(ep2out,setOutputFrames[b],0)
+
+    def worker(i):
+        try:
+            send(boards[i], shiftOutData(statuses[i]))
+            results[i][1] = time.monotonic()
+        except usb.core.USBError as e:
+            results[i][0] = e
+            barrier.abort() # don't latch half of the bank
+            return
+        try:
+            barrier.wait()
+        except threading.BrokenBarrierError:
+            results[i][0] = 'another board failed, not latched'
+            return
+        try:
+            send(boards[i], latchData)
+            results[i][2] = time.monotonic()
+        except usb.core.USBError as e:
+            results[i][0] = e
+
+    workers = [threading.Thread(target=worker, args=(i,))
+               for i in range(0, len(boards))]
+    for t in workers:
+        t.start()
+    for t in workers:
+        t.join()
+    return results
+
+### Set and verify the boards devs[i] for i in devIndexes, reports per board
+def setBank(devs, devIndexes, statuses):
+    global dev
+    boards = []
+    for devIndex in devIndexes:
+        if not (devIndex in range(0, len(devs))):
+            print('DEVICE',devIndex,'not found!')
+            sys.exit()
+        boards.append(devs[devIndex])
+    start = time.monotonic()
+    results = setRelaysConcurrent(boards, statuses)
+    latched = [r[2] for r in results if r[0] is None]
+    for i in range(0, len(boards)):
+        error, shifted, latch = results[i]
+        if error is not None:
+            print('DEVICE',devIndexes[i],'failed:',error)
+            continue
+        dev = boards[i]
+        verified = getRelays()==statuses[i]
+        print('DEVICE',devIndexes[i],'status set to',statuses[i],
+              'shifted in %.1f ms, latched %+.2f ms after the first,' %
+              ((shifted - start) * 1000, (latch - min(latched)) * 1000),
+              'verified' if verified else 'verification failed!')
 
 ### Shift in (read/verify) the relays status from Allegro A6275
 def getRelays():
@@ -149,6 +294,12 @@ def getRelays():
     ### This is bescause the Allegro A6275 data register may
     ### have different state, than its (latched) output register.
 
+    ### Every bit read goes back into the register with the CLK pulse
+    ### that shifts out the next one, so after 8 pulses the register
+    ### holds the status again and needs no write back. With batched
+    ### output, each bit costs one write (the CLK frames and the input
+    ### command) and one read.
+
     global dev
     result = 0
     
@@ -159,19 +310,21 @@ def getRelays():
         # READ bits from A6275 Serial out (at D7 line)...
         if (inputState & READ)!=0: 
            result = result | (1 << (7-i));
-        # ...and generate CLK pulse for next bi from A6275t...
-        setOutput(CLK) #CLK high
-        setOutput(0) #CLK low
+           bit = DATA
+        else:
+           bit = 0
+        # ...and generate CLK pulse for next bit, shifting this one in again
+        setOutput(bit) #DATA as read, CLK low
+        setOutput(CLK | bit) #CLK high
+    setOutput(0) #All lines 0
+    flushOutput()
 
     powerFail = 0
     if result == 255:
-        powerFail == ((inputState & PFT)!=0)
+        powerFail = ((inputState & PFT)!=0)
         if powerFail!=0:
             result = -1
 
-    if powerFail == 0 :
-        shiftOutBits(result) # write back status we shifted out before
-
     return result
 
 ################################################################
@@ -184,28 +337,516 @@ def getRelays():
 # so everthing below is getting arguments and error checking...
 ################################################################
 
+################ Kernel driver #################################
+# When the abacomrelay kernel driver (abacomrelay_driver/) is bound to
+# the boards, they show up as /dev/usb/relayboardN. Then the relays are
+# set with a single write() and read back with one ioctl(), without
+# pyUSB fighting the driver for the interface. N is the driver's
+# number of the board, pyUSB is only used if none of these exist (or
+# with --usb).
+################################################################
+
+kernelDevicePath = '/dev/usb/relayboard'
+kernelStatsPath = '/sys/kernel/debug/abacomrelay/relayboard'
+
+### ioctl numbers from abacomrelay.h
+def relayboardIoc(direction, nr, size): # direction 1 write, 2 read
+    return (direction << 30) | (size << 16) | (ord('R') << 8) | nr
+RELAYBOARD_IOC_READ_HW = relayboardIoc(2, 0x87, 2)
+RELAYBOARD_IOC_GROUP_SET = relayboardIoc(1, 0x90, 16)
+RELAYBOARD_HW_POWER_FAIL = 0x01
+
+class RelayboardGroupEntry(ctypes.Structure):
+    _fields_ = [('fd', ctypes.c_int32), ('mask', ctypes.c_uint8),
+                ('value', ctypes.c_uint8), ('reserved', ctypes.c_uint8 * 2),
+                ('result', ctypes.c_int32)]
+
+class RelayboardGroup(ctypes.Structure):
+    _fields_ = [('entries', ctypes.c_uint64), ('count', ctypes.c_uint32),
+                ('reserved', ctypes.c_uint32)]
+
+### numbers of the boards the kernel driver has
+def kernelDevices():
+    numbers = []
+    for path in glob.glob(kernelDevicePath + '*'):
+        try:
+            numbers.append(int(path[len(kernelDevicePath):]))
+        except ValueError:
+            pass
+    return sorted(numbers)
+
+def kernelOpen(devIndex):
+    return os.open(kernelDevicePath + str(devIndex), os.O_RDWR)
+
+### Set the relays, returns once the board latched them
+def kernelSetRelays(fd, aStatus):
+    os.write(fd, (str(aStatus) + '\n').encode('ascii'))
+
+### Read the relays back from the A6275, -1 on power fail like getRelays()
+def kernelGetRelays(fd):
+    hw = bytearray(2)
+    fcntl.ioctl(fd, RELAYBOARD_IOC_READ_HW, hw)
+    if hw[1] & RELAYBOARD_HW_POWER_FAIL:
+        return -1
+    return hw[0]
+
+### Set several boards together, the driver latches them right after each
+### other. Returns the error number (0 if none) of every board.
+def kernelSetBank(fds, statuses):
+    entries = (RelayboardGroupEntry * len(fds))()
+    for i in range(0, len(fds)):
+        entries[i].fd = fds[i]
+        entries[i].mask = 0xff
+        entries[i].value = statuses[i]
+    group = RelayboardGroup(ctypes.addressof(entries), len(fds), 0)
+    try:
+        fcntl.ioctl(fds[0], RELAYBOARD_IOC_GROUP_SET, group)
+    except OSError as e:
+        ### Usually every board has its own result, unless the driver
+        ### refused the whole request (EINVAL for a board given twice...)
+        if not [entry for entry in entries if entry.result != 0]:
+            return [-e.errno] * len(fds)
+    return [entry.result for entry in entries]
+
+### main() for boards of the kernel driver
+def kernelMain(devIndexes, statuses):
+    fds = [kernelOpen(devIndex) for devIndex in devIndexes]
+    for i in range(0, len(fds)):
+        print('DEVICE',devIndexes[i],'is',kernelDevicePath + str(devIndexes[i]))
+    if len(statuses) == 0: # no status specified in command line
+        for i in range(0, len(fds)):
+            print('DEVICE',devIndexes[i],'status read: ',kernelGetRelays(fds[i]))
+        return
+    if len(fds) == 1:
+        kernelSetRelays(fds[0], statuses[0])
+        print('Status set to', statuses[0])
+        results = [0]
+    else:
+        start = time.monotonic()
+        results = kernelSetBank(fds, statuses)
+        print('Boards set in %.1f ms' % ((time.monotonic() - start) * 1000))
+    for i in range(0, len(fds)):
+        if results[i] != 0:
+            print('DEVICE',devIndexes[i],'failed:',os.strerror(abs(results[i])))
+        elif kernelGetRelays(fds[i])==statuses[i]:
+            print('DEVICE',devIndexes[i],'status',statuses[i],'verified successfully.')
+        else:
+            print('DEVICE',devIndexes[i],'status',statuses[i],'verfication failed!')
+
+################ Daemon mode ###################################
+# With --daemon the script keeps running, holds on to all boards and
+# serves requests over a Unix socket, so callers don't pay for starting
+# Python, importing pyUSB and finding the boards every time. Boards of
+# the kernel driver are served through it (DEVICE N is relayboardN),
+# like everywhere else. usblrbc.py is a small client for it.
+#
+# One request per line, one answer line per request:
+#   set <deviceno> <status>        set the relays
+#   get <deviceno>                 status last set (no USB traffic)
+#   read <deviceno>                status read back from the board
+#   pulse <deviceno> <mask> <ms>   relays in mask on, off again after ms
+#   list                           device numbers of the boards
+# Answers are "ok <value>" or "error <message>".
+################################################################
+
+defaultSocket = '/run/usblrb.sock'
+
+### A board of the daemon, through pyUSB...
+class UsbBoard:
+    def __init__(self, device):
+        self.device = device
+    def set(self, status):
+        global dev
+        dev = self.device
+        setRelays(status)
+    def read(self):
+        global dev
+        dev = self.device
+        return getRelays()
+
+### ...or through the kernel driver
+class KernelBoard:
+    def __init__(self, devIndex):
+        self.fd = kernelOpen(devIndex)
+    def set(self, status):
+        kernelSetRelays(self.fd, status)
+    def read(self):
+        return kernelGetRelays(self.fd)
+
+### serves boards (device number -> board) on a Unix socket at path
+### until killed. USB and driver errors are both OSError.
+def serveDaemon(boards, path):
+    states = {} # last known status of every board
+    for devIndex in boards:
+        states[devIndex] = boards[devIndex].read()
+    pulses = [] # [time, deviceno, mask] of pulses still to end
+
+    def setState(devIndex, status):
+        boards[devIndex].set(status)
+        states[devIndex] = status
+
+    def handle(line):
+        words = line.split()
+        if len(words) == 0:
+            return 'error empty request'
+        try:
+            values = [int(w, 0) for w in words[1:]]
+        except ValueError:
+            return 'error invalid number'
+        cmd = words[0]
+        counts = {'set': 2, 'get': 1, 'read': 1, 'pulse': 3, 'list': 0}
+        if not cmd in counts:
+            return 'error unknown command'
+        if len(values) != counts[cmd]:
+            return 'error wrong number of arguments'
+        if cmd == 'list':
+            return 'ok ' + ' '.join(str(d) for d in sorted(boards))
+        devIndex = values[0]
+        if not devIndex in boards:
+            return 'error device not found'
+        if cmd == 'get':
+            return 'ok ' + str(states[devIndex])
+        if cmd == 'read':
+            states[devIndex] = boards[devIndex].read()
+            return 'ok ' + str(states[devIndex])
+        if not (values[1] in range(0, 256)):
+            return 'error status out of range'
+        old = states[devIndex] if states[devIndex] >= 0 else 0
+        if cmd == 'set':
+            setState(devIndex, values[1])
+        else:
+            setState(devIndex, old | values[1])
+            pulses.append([time.monotonic() + values[2] / 1000.0,
+                           devIndex, values[1]])
+        return 'ok ' + str(states[devIndex])
+
+    if os.path.exists(path):
+        os.unlink(path) # left over from a daemon that was killed
+    server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    server.bind(path)
+    server.listen(16)
+    print('Daemon serving', len(boards), 'device(s) at', path)
+    clients = {} # socket -> bytes received, but not a whole line yet
+    try:
+        while True:
+            timeout = None
+            if len(pulses) > 0:
+                timeout = max(0, min(p[0] for p in pulses) - time.monotonic())
+            ready = select.select([server] + list(clients), [], [], timeout)[0]
+            for sock in ready:
+                if sock is server:
+                    try:
+                        conn = server.accept()[0]
+                        clients[conn] = b''
+                    except OSError:
+                        pass # client gave up before we got to it
+                    continue
+                ### A client that goes away early only ends its connection
+                try:
+                    data = sock.recv(4096)
+                    if len(data) == 0:
+                        raise ConnectionResetError()
+                    clients[sock] += data
+                    while b'\n' in clients[sock]:
+                        line, clients[sock] = clients[sock].split(b'\n', 1)
+                        try:
+                            answer = handle(line.decode('ascii', 'replace'))
+                        except OSError as e: # USB or driver, not the client
+                            answer = 'error ' + str(e)
+                        sock.sendall((answer + '\n').encode('ascii'))
+                except OSError:
+                    sock.close()
+                    del clients[sock]
+            ### end pulses that are due
+            now = time.monotonic()
+            for pulse in [p for p in pulses if p[0] <= now]:
+                pulses.remove(pulse)
+                try:
+                    setState(pulse[1], max(0, states[pulse[1]]) & ~pulse[2])
+                except OSError as e:
+                    print('Pulse end failed on DEVICE', pulse[1], ':', e)
+    finally:
+        server.close()
+        os.unlink(path)
+
+################ Benchmark #####################################
+# --bench N switches a board N times through every backend there is
+# (pyUSB one write per frame, pyUSB batched, kernel driver) and reports
+# latency per state change, transfers per state change and state
+# changes per second. With --verify every state change is read back
+# too. --json prints the results as JSON instead.
+################################################################
+
+### Counts the transfers of a pyUSB device
+class CountingDevice:
+    def __init__(self, device):
+        self.device = device
+        self.transfers = 0
+    def write(self, *args):
+        self.transfers += 1
+        return self.device.write(*args)
+    def read(self, *args):
+        self.transfers += 1
+        return self.device.read(*args)
+
+### Run count state changes through setState (and getState), counted()
+### tells the transfers done so far
+def benchBackend(name, count, verify, setState, getState, counted):
+    latency = []
+    errors = 0
+    startTransfers = counted()
+    start = time.monotonic()
+    for i in range(0, count):
+        status = 0x55 if (i & 1) else 0xaa # every relay changes each time
+        t = time.monotonic()
+        setState(status)
+        if verify and getState() != status:
+            errors += 1
+        latency.append(time.monotonic() - t)
+    total = time.monotonic() - start
+    latency.sort()
+    def percentile(p):
+        return latency[int(p * (count - 1) + 0.5)] * 1e6
+    return {'backend': name, 'count': count, 'verify': verify,
+            'verify_errors': errors,
+            'min_us': round(latency[0] * 1e6, 1),
+            'p50_us': round(percentile(0.5), 1),
+            'p99_us': round(percentile(0.99), 1),
+            'max_us': round(latency[-1] * 1e6, 1),
+            'states_per_s': round(count / total, 1),
+            'transfers_per_op': round((counted() - startTransfers) / count, 2)}
+
+### Frames and USB transfers the kernel driver counted for the board
+### behind fd so far, from its debugfs statistics. Those are named after
+### the minor number. None if debugfs isn't mounted or readable
+def kernelUsbCounters(fd):
+    path = '%s%d/stats' % (kernelStatsPath, os.minor(os.fstat(fd).st_rdev))
+    try:
+        with open(path) as f:
+            lines = f.read().splitlines()
+    except OSError:
+        return None
+    frames = 0
+    transfers = 0
+    inTransfers = False
+    for line in lines:
+        if line.endswith(':'):
+            ### every transfer lands in one bucket of its latency histogram
+            inTransfers = line == 'transfer_latency:'
+        elif inTransfers:
+            transfers += int(line.split()[-1])
+        elif line.startswith('frames:'):
+            frames = int(line.split()[1])
+    return frames, transfers
+
+### Benchmark DEVICE devIndex with every backend that can reach it
+def runBench(devIndex, count, verify, asJson):
+    global dev, batchOutput
+    results = []
+    ### kernel driver, transfers are syscalls here, debugfs tells what
+    ### went over USB for them
+    if os.path.exists(kernelDevicePath + str(devIndex)):
+        calls = [0]
+        def kernelSet(status):
+            calls[0] += 1
+            kernelSetRelays(fd, status)
+        def kernelGet():
+            calls[0] += 1
+            return kernelGetRelays(fd)
+        fd = kernelOpen(devIndex)
+        try:
+            old = kernelGetRelays(fd)
+            before = kernelUsbCounters(fd)
+            result = benchBackend('kernel', count, verify, kernelSet,
+                                  kernelGet, lambda: calls[0])
+            after = kernelUsbCounters(fd)
+            result['transfer_unit'] = 'syscall'
+            ### what actually went over USB for those syscalls
+            result['usb_frames_per_op'] = None
+            result['usb_transfers_per_op'] = None
+            if before is not None and after is not None:
+                result['usb_frames_per_op'] = round(
+                    (after[0] - before[0]) / count, 2)
+                result['usb_transfers_per_op'] = round(
+                    (after[1] - before[1]) / count, 2)
+            results.append(result)
+            kernelSetRelays(fd, max(0, old))
+        except OSError as e:
+            results.append({'backend': 'kernel', 'error': e.strerror})
+        os.close(fd)
+    ### pyUSB, can't claim the board while the kernel driver has it
+    devs = []
+    if usb is not None:
+        devs = list(usb.core.find(find_all=1, idVendor=0x1A86, idProduct=0x5512) or [])
+    if devIndex in range(0, len(devs)):
+        dev = CountingDevice(devs[devIndex])
+        for name, batch in (('usb-frame', False), ('usb-batch', True)):
+            batchOutput = batch
+            try:
+                old = getRelays()
+                result = benchBackend(name, count, verify, setRelays,
+                                      getRelays, lambda: dev.transfers)
+                result['transfer_unit'] = 'usb'
+                results.append(result)
+                setRelays(max(0, old))
+            except usb.core.USBError as e:
+                results.append({'backend': name, 'error': str(e)})
+    if asJson:
+        print(json.dumps({'device': devIndex, 'results': results}, indent=2))
+        return
+    if len(results) == 0:
+        print('Device not found!')
+    for r in results:
+        if 'error' in r:
+            print('%-9s failed: %s' % (r['backend'], r['error']))
+            continue
+        usbText = ''
+        if r.get('usb_transfers_per_op') is not None:
+            usbText = ' (%.2f usb transfers, %.2f frames)' % (
+                r['usb_transfers_per_op'], r['usb_frames_per_op'])
+        print('%-9s %6d states %9.1f states/s  min %8.1f  p50 %8.1f  p99 %8.1f'
+              '  max %8.1f us  %5.2f %s transfers/state%s%s' %
+              (r['backend'], r['count'], r['states_per_s'], r['min_us'],
+               r['p50_us'], r['p99_us'], r['max_us'], r['transfers_per_op'],
+               r['transfer_unit'], usbText, ', %d verify errors'
+               % r['verify_errors'] if verify else ''))
+
+### Device numbers and status values from the command line, for --bank
+### the first 4 of available unless devices were given
+def parseBoards(devnoStrings, statusStrings, bankString, available):
+    try:
+        devIndexes = [int(d) for d in devnoStrings]
+        if bankString!='':
+            ### byte 0 for the first board, byte 1 for the second...
+            bank = int(bankString, 0)
+            if len(devIndexes) == 0:
+                devIndexes = list(available)[0:4]
+            statuses = [(bank >> (8 * i)) & 0xff
+                        for i in range(0, len(devIndexes))]
+        else:
+            statuses = [int(st) for st in statusStrings]
+    except ValueError:
+        print('Invalid device no. or status value!')
+        sys.exit()
+    if len(statuses) > 0 and len(statuses) != len(devIndexes):
+        print('Give one status for every device!')
+        sys.exit()
+    if [st for st in statuses if not (st in range(0,256))]:
+        print('Status value out of range (must be 0..255)')
+        sys.exit()
+    if len(devIndexes) == 0:
+        print('No device found!')
+        sys.exit()
+    ### Two workers on one board would mix up their frames
+    if len(set(devIndexes)) != len(devIndexes):
+        print('Give every device only once!')
+        sys.exit()
+    return devIndexes, statuses
+
 ### main method processes the command line ...
 def main(argv):
-    global dev
+    global dev, batchOutput
 
     ### Get string args from command line...
     devnoString= ''
     statusString = ''
+    devnoStrings = [] # -d and -s may be given several times
+    statusStrings = []
+    bankString = ''
+    useUsb = False
+    benchCount = 0
+    benchVerify = False
+    benchJson = False
+    daemonMode = False
+    socketPath = defaultSocket
+    usage = ('usage: sudo usblrb.py -d <deviceno> -s <status> [-d <deviceno> -s <status> ...] [--no-batch]\n'
+             '       sudo usblrb.py [-d <deviceno> ...] --bank <status> [--no-batch]\n'
+             '       sudo usblrb.py --daemon [--socket <path>] [--no-batch]\n'
+             '       sudo usblrb.py [-d <deviceno>] --bench <count> [--verify] [--json]\n'
+             '       --usb: use pyUSB even if the kernel driver has the boards')
     try:
-        opts, args = getopt.getopt(argv,"hd:s:",["deviceno=","status="])
+        opts, args = getopt.getopt(argv,"hd:s:",["deviceno=","status=","no-batch",
+                                                 "daemon","socket=","bank=","usb",
+                                                 "bench=","verify","json"])
     except getopt.GetoptError:
-        print('usage: sudo usblrb.py -d <deviceno> -s <status>')
+        print(usage)
         sys.exit(2)
     for opt, arg in opts:
         if opt == '-h':
-            print('usage: sudo usblrb.py -d <deviceno> -s <status>')
+            print(usage)
             sys.exit()
+        elif opt == "--no-batch": # one USB write per frame
+            batchOutput = False
+        elif opt == "--daemon":
+            daemonMode = True
+        elif opt == "--socket":
+            socketPath = arg
+        elif opt == "--bench":
+            try:
+                benchCount = int(arg)
+            except ValueError:
+                benchCount = 0
+            if benchCount < 1:
+                print(usage)
+                sys.exit(2)
+        elif opt == "--verify":
+            benchVerify = True
+        elif opt == "--json":
+            benchJson = True
+        elif opt == "--usb":
+            useUsb = True
+        elif opt == "--bank":
+            bankString = arg
         elif opt in ("-d", "--deviceno"):
             devnoString = arg
+            devnoStrings.append(arg)
         elif opt in ("-s", "--status"):
             statusString = arg
+            statusStrings.append(arg)
     ### We got the args now, so we can try to use it....
 
+    if benchCount > 0:
+        try:
+            devIndex = int(devnoString or '0')
+        except ValueError:
+            print('Invalid device no.!')
+            sys.exit()
+        runBench(devIndex, benchCount, benchVerify, benchJson)
+        sys.exit()
+
+    ### Boards of the kernel driver go through it...
+    kernelDevs = []
+    if not useUsb:
+        kernelDevs = kernelDevices()
+    if len(kernelDevs) > 0 and daemonMode:
+        try:
+            boards = dict((d, KernelBoard(d)) for d in kernelDevs)
+            serveDaemon(boards, socketPath)
+        except OSError as e:
+            print('Device error!', e.strerror)
+        sys.exit()
+    if len(kernelDevs) > 0:
+        if len(devnoStrings) == 0 and bankString=='':
+            for devIndex in kernelDevs: # Print out the device list...
+                print('DEVICE',devIndex,'is',kernelDevicePath + str(devIndex))
+            print('usage: sudo usblrb.py -d <deviceno> -s <status>')
+            sys.exit()
+        devIndexes, statuses = parseBoards(devnoStrings, statusStrings,
+                                           bankString, kernelDevs)
+        if [d for d in devIndexes if not d in kernelDevs]:
+            print('Device not found!')
+            sys.exit()
+        try:
+            kernelMain(devIndexes, statuses)
+        except OSError as e:
+            print('Device error!', e.strerror)
+        sys.exit()
+
+    ### ...all others through pyUSB
+    if usb is None:
+        print('No kernel driver device found and pyUSB not installed!')
+        sys.exit()
+
 
     ### Next we need to find a CH341A DEVICE in EPP/MEM/I2C mode on USB...
 
@@ -220,6 +861,26 @@ def main(argv):
        sys.exit()
 
     devs = list(devs_iter)
+    if daemonMode:
+        if len(devs) == 0:
+            print('No device found!')
+            sys.exit()
+        try:
+            serveDaemon(dict((i, UsbBoard(devs[i])) for i in range(0, len(devs))),
+                        socketPath)
+        except usb.core.USBError as e: # e.g. the kernel driver has the board
+            print('Device error!', e)
+        sys.exit()
+
+    ### Several boards at once...
+    if len(devnoStrings) > 1 or bankString!='':
+        devIndexes, statuses = parseBoards(devnoStrings, statusStrings,
+                                           bankString, range(0, len(devs)))
+        if len(statuses) == 0:
+            print('Give one status for every device!')
+            sys.exit()
+        setBank(devs, devIndexes, statuses)
+        sys.exit()
     if devnoString=='': # no device specified in command line
         for i in range(0, len(devs)): # Print out the decive list...
             dev = devs[i]
@@ -252,11 +913,11 @@ def main(argv):
         # and read the current status in case...
         oldStatus = getRelays() # get the relay status
         testStatus = not oldStatus
-        shiftOutBits(testStatus) # shift out some other status (silent without latch)
+        writeBits(testStatus) # shift out some other status (silent without latch)
         status = getRelays() # readback new (test status)
         if status == testStatus: # does it match?
            print('Status read: ',oldStatus) # print out the status
-           shiftOutBits(oldStatus) # restore status we had before test
+           writeBits(oldStatus) # restore status we had before test
         else:
            print('Bad device') # this is likely not a USB-LRB
         sys.exit()
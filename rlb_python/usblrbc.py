@@ -0,0 +1,75 @@
+#
+# Client for the daemon mode of usblrb.py
+# https://github.com/jonesman/ABACOM-Relayboard
+#
+# Only needs the Python standard library, so it starts fast enough
+# to be called from hooks and automations many times an hour.
+
+#######################################################################
+### usage: usblrbc.py [-S <socket>] <request>
+#######################################################################
+
+### start the daemon first ...
+###     sudo python ./usblrb.py --daemon
+
+### then, for example ...
+###     python ./usblrbc.py set 0 123        set relays of DEVICE 0
+###     python ./usblrbc.py get 0            status last set
+###     python ./usblrbc.py read 0           status read from the board
+###     python ./usblrbc.py pulse 0 1 500    relay1 on for 500 ms
+###     python ./usblrbc.py list             device numbers of the boards
+
+### The answer is printed, the exit code is 1 if it is an error.
+
+import sys
+import socket
+import getopt
+
+defaultSocket = '/run/usblrb.sock' # same as in usblrb.py
+
+### sends request to the daemon at path, returns the answer line
+def request(path, line):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        sock.connect(path)
+        sock.sendall((line + '\n').encode('ascii'))
+        answer = b''
+        while not b'\n' in answer:
+            data = sock.recv(4096)
+            if len(data) == 0:
+                break
+            answer += data
+    finally:
+        sock.close()
+    return answer.decode('ascii').strip()
+
+def main(argv):
+    socketPath = defaultSocket
+    try:
+        opts, args = getopt.getopt(argv,"hS:",["socket="])
+    except getopt.GetoptError:
+        print('usage: usblrbc.py [-S <socket>] <request>')
+        sys.exit(2)
+    for opt, arg in opts:
+        if opt == '-h':
+            print('usage: usblrbc.py [-S <socket>] <request>')
+            sys.exit()
+        elif opt in ("-S", "--socket"):
+            socketPath = arg
+    if len(args) == 0:
+        print('usage: usblrbc.py [-S <socket>] <request>')
+        sys.exit(2)
+
+    try:
+        answer = request(socketPath, ' '.join(args))
+    except OSError as e:
+        print('Daemon not reachable at', socketPath, ':', e.strerror)
+        sys.exit(1)
+    print(answer)
+    if not answer.startswith('ok'):
+        sys.exit(1)
+
+##############################################################
+### call the main method with arguments from command line ...
+if __name__ == "__main__":
+   main(sys.argv[1:])